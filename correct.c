@@ -0,0 +1,377 @@
+#include <math.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "correct.h"
+#include "parse.h"
+#include "debug.h"
+
+/* Temperature and pressure of the standard atmosphere. */
+#define STP_KELVIN			273.15
+#define STP_PRESSURE		1013.25
+
+/*
+ * Batch of fiducials laid out as structure of arrays, so every
+ * correction kernel below is a plain loop over contiguous doubles
+ * which the compiler can vectorize.
+ */
+struct correct_batch {
+	unsigned int count;
+	double rec_time[CORRECT_BATCH_SIZE];
+	double latitude[CORRECT_BATCH_SIZE];
+	double longitude[CORRECT_BATCH_SIZE];
+	unsigned int line_nr[CORRECT_BATCH_SIZE];
+	double live_time[CORRECT_BATCH_SIZE];
+	double height[CORRECT_BATCH_SIZE];
+	double pressure[CORRECT_BATCH_SIZE];
+	double temperature[CORRECT_BATCH_SIZE];
+	double cosmic[CORRECT_BATCH_SIZE];
+	double win[NR_WINDOWS][CORRECT_BATCH_SIZE];
+};
+
+static FILE *fp_cor = NULL;
+static struct correct_coeffs cor;
+static struct correct_batch batch;
+static unsigned int win_first[NR_WINDOWS], win_last[NR_WINDOWS];
+static unsigned int cosmic_first;
+
+void correct_default_coeffs(struct correct_coeffs *coeffs)
+{
+	static const double lo[NR_WINDOWS] = { 400.0, 1370.0, 1660.0, 2410.0 };
+	static const double hi[NR_WINDOWS] = { 2810.0, 1570.0, 1860.0, 2810.0 };
+	static const double aircraft_bg[NR_WINDOWS] = { 60.0, 10.0, 3.0, 1.0 };
+	static const double cosmic_bg[NR_WINDOWS] = { 0.90, 0.050, 0.045, 0.055 };
+	static const double atten[NR_WINDOWS] = { 0.0070, 0.0085, 0.0075, 0.0065 };
+
+	coeffs->kev_per_channel = 3.0;
+	coeffs->kev_offset = 0.0;
+	coeffs->live_time_unit = 1e-6;
+	coeffs->cosmic_kev = 3000.0;
+	memcpy(coeffs->win_lo, lo, sizeof(lo));
+	memcpy(coeffs->win_hi, hi, sizeof(hi));
+	memcpy(coeffs->aircraft_bg, aircraft_bg, sizeof(aircraft_bg));
+	memcpy(coeffs->cosmic_bg, cosmic_bg, sizeof(cosmic_bg));
+	coeffs->alpha = 0.27;
+	coeffs->beta = 0.42;
+	coeffs->gamma = 0.78;
+	coeffs->a = 0.06;
+	memcpy(coeffs->atten, atten, sizeof(atten));
+	coeffs->nominal_height = 120.0;
+}
+
+#define COEFF(name, member) { name, offsetof(struct correct_coeffs, member) }
+
+static const struct {
+	const char *name;
+	size_t offset;
+} coeff_keys[] = {
+	COEFF("kev_per_channel", kev_per_channel),
+	COEFF("kev_offset", kev_offset),
+	COEFF("live_time_unit", live_time_unit),
+	COEFF("cosmic_kev", cosmic_kev),
+	COEFF("window_tc_lo", win_lo[WIN_TC]),
+	COEFF("window_tc_hi", win_hi[WIN_TC]),
+	COEFF("window_k_lo", win_lo[WIN_K]),
+	COEFF("window_k_hi", win_hi[WIN_K]),
+	COEFF("window_u_lo", win_lo[WIN_U]),
+	COEFF("window_u_hi", win_hi[WIN_U]),
+	COEFF("window_th_lo", win_lo[WIN_TH]),
+	COEFF("window_th_hi", win_hi[WIN_TH]),
+	COEFF("aircraft_bg_tc", aircraft_bg[WIN_TC]),
+	COEFF("aircraft_bg_k", aircraft_bg[WIN_K]),
+	COEFF("aircraft_bg_u", aircraft_bg[WIN_U]),
+	COEFF("aircraft_bg_th", aircraft_bg[WIN_TH]),
+	COEFF("cosmic_bg_tc", cosmic_bg[WIN_TC]),
+	COEFF("cosmic_bg_k", cosmic_bg[WIN_K]),
+	COEFF("cosmic_bg_u", cosmic_bg[WIN_U]),
+	COEFF("cosmic_bg_th", cosmic_bg[WIN_TH]),
+	COEFF("alpha", alpha),
+	COEFF("beta", beta),
+	COEFF("gamma", gamma),
+	COEFF("a", a),
+	COEFF("atten_tc", atten[WIN_TC]),
+	COEFF("atten_k", atten[WIN_K]),
+	COEFF("atten_u", atten[WIN_U]),
+	COEFF("atten_th", atten[WIN_TH]),
+	COEFF("nominal_height", nominal_height),
+};
+
+/*
+ * Coefficient file holds one "name value" pair per line, lines
+ * starting with '#' are comments. Coefficients not mentioned in the
+ * file keep their current value.
+ */
+int correct_load_coeffs(const char *filename, struct correct_coeffs *coeffs)
+{
+	FILE *fp = NULL;
+	char buf[256] = "";
+	unsigned int line = 0;
+
+	if (filename == NULL || coeffs == NULL)
+		return -1;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		DEBUG("Failed to open file: %s", filename);
+		return -1;
+	}
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		char name[64] = "";
+		double val = 0.0;
+		register unsigned int i;
+
+		line++;
+		if (buf[0] == '#' || sscanf(buf, "%63s", name) != 1)
+			continue;
+
+		if (sscanf(buf, "%63s %lf", name, &val) != 2) {
+			DEBUG("%s:%u: Failed to extract coefficient value.", filename, line);
+			continue;
+		}
+
+		for (i = 0; i < sizeof(coeff_keys) / sizeof(coeff_keys[0]); i++) {
+			if (!strcmp(name, coeff_keys[i].name)) {
+				*(double *)((char *)coeffs + coeff_keys[i].offset) = val;
+				break;
+			}
+		}
+		if (i == sizeof(coeff_keys) / sizeof(coeff_keys[0]))
+			DEBUG("%s:%u: Unknown coefficient: %s", filename, line, name);
+	}
+	fclose(fp);
+	return 0;
+}
+
+static unsigned int kev_to_channel(const struct correct_coeffs *coeffs, double kev)
+{
+	double ch = floor((kev - coeffs->kev_offset) / coeffs->kev_per_channel);
+
+	if (ch < 0)
+		return 0;
+	if (ch > NR_CHANNELS)
+		return NR_CHANNELS;
+	return (unsigned int)ch;
+}
+
+static void correct_live_time(struct correct_batch *b)
+{
+	const double unit = cor.live_time_unit;
+	double *restrict live = b->live_time;
+	double *restrict cosmic = b->cosmic;
+	register unsigned int i, w;
+
+	/* Turn live time into a scale factor, counts become cps. */
+	for (i = 0; i < b->count; i++)
+		live[i] = live[i] > 0 ? 1.0 / (live[i] * unit) : 0.0;
+
+	for (i = 0; i < b->count; i++)
+		cosmic[i] *= live[i];
+
+	for (w = 0; w < NR_WINDOWS; w++) {
+		double *restrict win = b->win[w];
+
+		for (i = 0; i < b->count; i++)
+			win[i] *= live[i];
+	}
+}
+
+static void correct_background(struct correct_batch *b)
+{
+	const double *restrict cosmic = b->cosmic;
+	register unsigned int i, w;
+
+	for (w = 0; w < NR_WINDOWS; w++) {
+		const double aircraft = cor.aircraft_bg[w];
+		const double slope = cor.cosmic_bg[w];
+		double *restrict win = b->win[w];
+
+		for (i = 0; i < b->count; i++)
+			win[i] -= aircraft + slope * cosmic[i];
+	}
+}
+
+static void correct_stripping(struct correct_batch *b)
+{
+	const double scale = 1.0 / (1.0 - cor.a * cor.alpha);
+	const double alpha = cor.alpha, beta = cor.beta, gamma = cor.gamma, a = cor.a;
+	double *restrict k = b->win[WIN_K];
+	double *restrict u = b->win[WIN_U];
+	double *restrict th = b->win[WIN_TH];
+	register unsigned int i;
+
+	for (i = 0; i < b->count; i++) {
+		double th_s = (th[i] - a * u[i]) * scale;
+		double u_s = (u[i] - alpha * th[i]) * scale;
+
+		k[i] = k[i] - beta * th_s - gamma * u_s;
+		u[i] = u_s;
+		th[i] = th_s;
+	}
+}
+
+static void correct_height(struct correct_batch *b)
+{
+	double *restrict height = b->height;
+	const double *restrict pressure = b->pressure;
+	const double *restrict temperature = b->temperature;
+	register unsigned int i, w;
+
+	/*
+	 * Radar altimeter height reduced to standard temperature and pressure,
+	 * fiducials without a height are NaN and come out blank.
+	 */
+	for (i = 0; i < b->count; i++) {
+		height[i] = height[i] * (STP_KELVIN / (temperature[i] + STP_KELVIN)) *
+					(pressure[i] / STP_PRESSURE);
+	}
+
+	for (w = 0; w < NR_WINDOWS; w++) {
+		const double mu = cor.atten[w];
+		const double h0 = cor.nominal_height;
+		double *restrict win = b->win[w];
+
+		for (i = 0; i < b->count; i++)
+			win[i] *= exp(mu * (height[i] - h0));
+	}
+}
+
+/* NaN marks a value that could not be corrected, it is left blank. */
+static inline void format_value(const char *fmt, double v)
+{
+	if (isnan(v))
+		fprintf(fp_cor, "%s", ",");
+	else
+		fprintf(fp_cor, fmt, v);
+}
+
+static void format_batch(const struct correct_batch *b)
+{
+	register unsigned int i, w;
+
+	for (i = 0; i < b->count; i++) {
+		fprintf(fp_cor, "%lf,%d,%7.4lf,%7.4lf,", b->rec_time[i], b->line_nr[i],
+				b->latitude[i], b->longitude[i]);
+		format_value("%.1f,", b->height[i]);
+		format_value("%.2f,", b->cosmic[i]);
+		for (w = 0; w < NR_WINDOWS; w++)
+			format_value("%.2f,", b->win[w][i]);
+		fprintf(fp_cor, "%s", "\n");
+	}
+}
+
+static void flush_batch(void)
+{
+	if (batch.count == 0)
+		return;
+
+	correct_live_time(&batch);
+	correct_background(&batch);
+	correct_stripping(&batch);
+	correct_height(&batch);
+	format_batch(&batch);
+	batch.count = 0;
+}
+
+int correct_open_file(const char *filename, const struct correct_coeffs *coeffs)
+{
+	register unsigned int w;
+
+	if (filename == NULL || coeffs == NULL)
+		return -1;
+
+	if (coeffs->kev_per_channel <= 0) {
+		DEBUG("Invalid energy calibration: %lf keV/channel", coeffs->kev_per_channel);
+		return -1;
+	}
+
+	fp_cor = fopen(filename, "w");
+	if (fp_cor == NULL) {
+		DEBUG("Failed to open file: %s", filename);
+		return -1;
+	}
+
+	cor = *coeffs;
+	for (w = 0; w < NR_WINDOWS; w++) {
+		win_first[w] = kev_to_channel(&cor, cor.win_lo[w]);
+		win_last[w] = kev_to_channel(&cor, cor.win_hi[w]);
+	}
+	cosmic_first = kev_to_channel(&cor, cor.cosmic_kev);
+	batch.count = 0;
+
+	fprintf(fp_cor, "%s", "REC_TIME,LINE_NUM,GPS_LAT,GPS_LON,STP_ALT,COSMIC,"
+						"TC_COR,K_COR,U_COR,TH_COR,\n");
+	return 0;
+}
+
+void correct_push(const struct fiducial_data *fid)
+{
+	const unsigned int *spec = fid->rsx.vd_dn.spectrum;
+	unsigned int n = batch.count;
+	unsigned long sum;
+	register unsigned int i, w;
+
+	if (fp_cor == NULL)
+		return;
+
+	batch.rec_time[n] = fid->rec_time;
+	batch.latitude[n] = fid->gga.latitude;
+	batch.longitude[n] = fid->gga.longitude;
+	batch.line_nr[n] = fid->line.line_nr;
+	batch.live_time[n] = fid->rsx.vd_dn.live_time;
+	batch.height[n] = fid->ral.agl_height;
+	/* No height correction until altimeter, pressure and temperature reported */
+	if (!fid->ral.seen || !fid->bar.seen || !fid->trm.seen ||
+			fid->trm.temperature + STP_KELVIN <= 0)
+		batch.height[n] = NAN;
+	batch.pressure[n] = fid->bar.pressure;
+	batch.temperature[n] = fid->trm.temperature;
+
+	for (w = 0; w < NR_WINDOWS; w++) {
+		for (i = win_first[w], sum = 0; i < win_last[w]; i++)
+			sum += spec[i];
+		batch.win[w][n] = sum;
+	}
+	for (i = cosmic_first, sum = 0; i < NR_CHANNELS; i++)
+		sum += spec[i];
+	batch.cosmic[n] = sum;
+
+	/* Without live time there is no rate, NaN blanks cosmic and windows */
+	if (!fid->rsx.seen || fid->rsx.vd_dn.live_time == 0)
+		batch.cosmic[n] = NAN;
+
+	if (++batch.count == CORRECT_BATCH_SIZE)
+		flush_batch();
+}
+
+/* Live time normalized, otherwise uncorrected, window count rates. */
+void correct_window_rates(const struct fiducial_data *fid,
+							const struct correct_coeffs *coeffs,
+							double rates[NR_WINDOWS])
+{
+	const unsigned int *spec = fid->rsx.vd_dn.spectrum;
+	double live = fid->rsx.vd_dn.live_time * coeffs->live_time_unit;
+	unsigned long sum;
+	register unsigned int i, w;
+
+	for (w = 0; w < NR_WINDOWS; w++) {
+		unsigned int last = kev_to_channel(coeffs, coeffs->win_hi[w]);
+
+		for (i = kev_to_channel(coeffs, coeffs->win_lo[w]), sum = 0; i < last; i++)
+			sum += spec[i];
+		rates[w] = live > 0 ? sum / live : 0.0;
+	}
+}
+
+void correct_close_file(void)
+{
+	if (fp_cor == NULL)
+		return;
+
+	flush_batch();
+	fclose(fp_cor);
+	fp_cor = NULL;
+}
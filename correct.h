@@ -0,0 +1,47 @@
+#ifndef CORRECT_H_INCLUDED
+#define CORRECT_H_INCLUDED
+
+struct fiducial_data;
+
+/* Number of fiducials corrected together by the batch kernels. */
+#define CORRECT_BATCH_SIZE		4096
+
+/* Radiometric energy windows. */
+typedef enum window_t {
+	WIN_TC = 0,
+	WIN_K,
+	WIN_U,
+	WIN_TH,
+	NR_WINDOWS
+} window_t;
+
+/* Coefficients used by the correction stage. */
+struct correct_coeffs {
+	double kev_per_channel;			/* Spectrum energy calibration gain */
+	double kev_offset;				/* Spectrum energy calibration offset */
+	double live_time_unit;			/* Seconds per live time tick */
+	double cosmic_kev;				/* Lower limit of cosmic window in keV */
+	double win_lo[NR_WINDOWS];		/* Lower window limits in keV */
+	double win_hi[NR_WINDOWS];		/* Upper window limits in keV */
+	double aircraft_bg[NR_WINDOWS];	/* Aircraft background in cps */
+	double cosmic_bg[NR_WINDOWS];	/* Window cps per cosmic cps */
+	double alpha;					/* Th into U stripping ratio */
+	double beta;					/* Th into K stripping ratio */
+	double gamma;					/* U into K stripping ratio */
+	double a;						/* U into Th (reverse) stripping ratio */
+	double atten[NR_WINDOWS];		/* Height attenuation coefficients in 1/m */
+	double nominal_height;			/* Survey height in meters */
+};
+
+extern void correct_default_coeffs(struct correct_coeffs *coeffs);
+extern int correct_load_coeffs(const char *filename, struct correct_coeffs *coeffs);
+
+extern int correct_open_file(const char *filename, const struct correct_coeffs *coeffs);
+extern void correct_close_file(void);
+extern void correct_push(const struct fiducial_data *fid);
+
+extern void correct_window_rates(const struct fiducial_data *fid,
+								const struct correct_coeffs *coeffs,
+								double rates[NR_WINDOWS]);
+
+#endif	/* CORRECT_H_INCLUDED */
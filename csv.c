@@ -1,108 +1,332 @@
 #include <stdio.h>
 #include <math.h>
+#include <errno.h>
 #include <stdarg.h>
+#include <string.h>
 #include <stdlib.h>
 
 #include "csv.h"
 #include "debug.h"
 #include "parse.h"
+#include "schema.h"
+
+#define CSV_FLUSH_SIZE		(64 * 1024)
 
 static FILE *fp_csv = NULL;
+static struct csv_buffer buf_csv;
 
-static void format_data(FILE *fp, const char *fmt, ...)
+static void format_data(struct csv_buffer *buf, const char *fmt, ...)
 {
 	va_list ap;
-	
-	va_start(ap, fmt);
-	vfprintf(fp, fmt, ap);
-	va_end(ap);
+	int len;
+
+	if (buf->data == NULL && csv_buffer_reserve(buf, 1) != 0)
+		return;
+
+	for (;;) {
+		size_t avail = buf->size - buf->len;
+
+		va_start(ap, fmt);
+		len = vsnprintf(buf->data + buf->len, avail, fmt, ap);
+		va_end(ap);
+
+		if (len < 0)
+			return;
+		if ((size_t)len < avail) {
+			buf->len += len;
+			return;
+		}
+		if (csv_buffer_reserve(buf, len + 1) != 0)
+			return;
+	}
+}
+
+/* Makes room for at least extra more bytes, including the terminator. */
+int csv_buffer_reserve(struct csv_buffer *buf, size_t extra)
+{
+	size_t size = buf->size ? buf->size : 4096;
+	char *tmp;
+
+	if (buf->len + extra <= buf->size)
+		return 0;
+
+	while (size < buf->len + extra)
+		size *= 2;
+
+	tmp = realloc(buf->data, size);
+	if (tmp == NULL) {
+		DEBUG("Out of memory.");
+		return -1;
+	}
+	buf->data = tmp;
+	buf->size = size;
+	return 0;
+}
+
+void csv_buffer_free(struct csv_buffer *buf)
+{
+	free(buf->data);
+	memset(buf, 0, sizeof(*buf));
+}
+
+#define CSV_FIELD_MAX		64		/* longest column of a finite value */
+
+static const double pow10_table[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6 };
+
+/* Makes room for one more column, returns where it goes. */
+static inline char *field_start(struct csv_buffer *buf)
+{
+	if (buf->len + CSV_FIELD_MAX > buf->size &&
+			csv_buffer_reserve(buf, CSV_FIELD_MAX) != 0)
+		return NULL;
+	return buf->data + buf->len;
+}
+
+static inline void field_end(struct csv_buffer *buf, char *p)
+{
+	*p++ = ',';
+	buf->len = p - buf->data;
+}
+
+/* Decimal digits of v, zero padded to width. */
+static inline char *put_uint(char *p, unsigned long long v, unsigned int width)
+{
+	char tmp[24];
+	unsigned int n = 0;
+
+	do {
+		tmp[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v);
+	while (n < width)
+		tmp[n++] = '0';
+	while (n)
+		*p++ = tmp[--n];
+	return p;
+}
+
+/* Same as %0*ld. */
+static inline char *put_int(char *p, long v, unsigned int width)
+{
+	if (v < 0) {
+		*p++ = '-';
+		return put_uint(p, -(unsigned long)v, width ? width - 1 : 0);
+	}
+	return put_uint(p, v, width);
+}
+
+/*
+ * Same as %*.*f: the scaled value is rounded half to even on its exact
+ * binary value, like printf does. A product landing exactly on a half
+ * is settled by the rounding error of the product. Values out of exact
+ * integer range, infinities and NaNs are left to printf.
+ */
+static void emit_fixed(struct csv_buffer *buf, double v, unsigned int prec, unsigned int width)
+{
+	double x = fabs(v), hi, r, d;
+	unsigned long long n, scale = pow10_table[prec];
+	char tmp[CSV_FIELD_MAX], *q = tmp, *p;
+	unsigned int len;
+
+	hi = x * pow10_table[prec];
+	if (!(hi < 4503599627370496.0)) {
+		format_data(buf, "%*.*f,", width, prec, v);
+		return;
+	}
+
+	r = nearbyint(hi);
+	d = hi - r;
+	if (d == 0.5 && fma(x, pow10_table[prec], -hi) > 0)
+		r += 1;
+	else if (d == -0.5 && fma(x, pow10_table[prec], -hi) < 0)
+		r -= 1;
+	n = r;
+
+	if (signbit(v))
+		*q++ = '-';
+	q = put_uint(q, n / scale, 0);
+	if (prec) {
+		*q++ = '.';
+		q = put_uint(q, n % scale, prec);
+	}
+
+	p = field_start(buf);
+	if (p == NULL)
+		return;
+	for (len = q - tmp; len < width; len++)
+		*p++ = ' ';
+	memcpy(p, tmp, q - tmp);
+	field_end(buf, p + (q - tmp));
+}
+
+/* One emitter per column kind of schema.h. */
+static inline void emit_F6(struct csv_buffer *buf, kind_F6_t v)
+{
+	emit_fixed(buf, v, 6, 0);
+}
+
+static inline void emit_DEG(struct csv_buffer *buf, kind_DEG_t v)
+{
+	emit_fixed(buf, v, 4, 7);
 }
 
-static void format_header(void)
+static inline void emit_F2(struct csv_buffer *buf, kind_F2_t v)
+{
+	emit_fixed(buf, v, 2, 0);
+}
+
+static inline void emit_F1(struct csv_buffer *buf, kind_F1_t v)
+{
+	emit_fixed(buf, v, 1, 0);
+}
+
+static inline void emit_INT(struct csv_buffer *buf, kind_INT_t v)
+{
+	char *p = field_start(buf);
+
+	if (p)
+		field_end(buf, put_int(p, v, 0));
+}
+
+static inline void emit_LONG(struct csv_buffer *buf, kind_LONG_t v)
+{
+	char *p = field_start(buf);
+
+	if (p)
+		field_end(buf, put_int(p, v, 0));
+}
+
+static inline void emit_CHAR(struct csv_buffer *buf, kind_CHAR_t v)
+{
+	char *p = field_start(buf);
+
+	if (p) {
+		*p++ = v;
+		field_end(buf, p);
+	}
+}
+
+static inline void emit_DATE(struct csv_buffer *buf, kind_DATE_t v)
+{
+	char *p = field_start(buf);
+
+	if (p == NULL)
+		return;
+	p = put_int(p, v.year, 4);
+	*p++ = '/';
+	p = put_int(p, v.mon, 2);
+	*p++ = '/';
+	p = put_int(p, v.mday, 2);
+	field_end(buf, p);
+}
+
+static inline void emit_TIME(struct csv_buffer *buf, kind_TIME_t v)
+{
+	char *p = field_start(buf);
+
+	if (p == NULL)
+		return;
+	p = put_int(p, v.hours, 2);
+	*p++ = ':';
+	p = put_int(p, v.minutes, 2);
+	*p++ = ':';
+	buf->len = p - buf->data;
+	emit_fixed(buf, v.seconds, 2, 4);
+}
+
+static inline void emit_EMPTY(struct csv_buffer *buf, kind_EMPTY_t v)
+{
+	char *p = field_start(buf);
+
+	(void)v;
+	if (p)
+		field_end(buf, p);
+}
+
+static void put_name(struct csv_buffer *buf, const char *name, int index, unsigned int digits)
+{
+	size_t len = strlen(name);
+	char *p = field_start(buf);
+
+	if (p == NULL)
+		return;
+	memcpy(p, name, len);
+	p += len;
+	if (digits)
+		p = put_int(p, index, digits);
+	field_end(buf, p);
+}
+
+void csv_format_header(struct csv_buffer *buf)
+{
+	register unsigned int i;
+
+#define HEADER_COL(name, kind, value)	put_name(buf, #name, 0, 0);
+#define HEADER_ARR(name, kind, count, digits, array)	\
+	for (i = 1; i < (count) + 1; i++)					\
+		put_name(buf, #name, i, digits);
+	FIDUCIAL_COLUMNS(HEADER_COL, HEADER_ARR)
+#undef HEADER_COL
+#undef HEADER_ARR
+
+	if (csv_buffer_reserve(buf, 2) == 0)
+		buf->data[buf->len++] = '\n';
+}
+
+void csv_format_row(struct csv_buffer *buf, const struct fiducial_data *fid)
 {
 	register unsigned int i;
-	
-	format_data(fp_csv, "%s", "REC_TIME,GPS_DATE,GPS_TIME,GPS_LAT,GPS_LON,"
-							"GPS_ALT,GPS_FIX,GPS_SATS,GPS_HDOP,RAD_ALT,"
-							"LINE_NUM,BAR,TRM,HUM,MAG,MAG_AMP,RSX_TIME,");
-	
-	for (i = 1; i < NR_CRYSTALS + 1; i++)
-		format_data(fp_csv, "CR%02d,", i);
-	for (i = 1; i < NR_CRYSTALS + 1; i++)
-		format_data(fp_csv, "CR_ERR%02d,", i);
 
-	format_data(fp_csv, "%s", "ACQ_TIME_D,ACQ_TIME_U,LIVE_TIME_D,"
-							"LIVE_TIME_U,GAMMA_TOTAL_D,GAMMA_TOTAL_U,");
+#define EMIT_COL(name, kind, value)	emit_##kind(buf, (value));
+#define EMIT_ARR(name, kind, count, digits, array)	\
+	for (i = 0; i < (count); i++)					\
+		emit_##kind(buf, (array)[i]);
+	FIDUCIAL_COLUMNS(EMIT_COL, EMIT_ARR)
+#undef EMIT_COL
+#undef EMIT_ARR
 
-	
-	//for (i = 1; i < NR_CHANNELS + 1; i++)
-		//format_data(fp_csv, "D%04d,", i);
-	//for (i = 1; i < NR_CHANNELS + 1; i++)
-		//format_data(fp_csv, "U%04d,", i);	
+	if (csv_buffer_reserve(buf, 2) == 0)
+		buf->data[buf->len++] = '\n';
+}
 
-	format_data(fp_csv, "%s", "\n");	
+static void flush_csv(void)
+{
+	if (buf_csv.len > 0 && fwrite(buf_csv.data, buf_csv.len, 1, fp_csv) != 1)
+		DEBUG("Failed to write csv file.");
+	buf_csv.len = 0;
 }
 
 int csv_open_file(const char *filename)
 {
 	if (filename == NULL)
 		return -1;
-		
+
 	fp_csv = fopen(filename, "w");
 	if (fp_csv == NULL) {
 		DEBUG("Failed to open file: %s", filename);
 		return -1;
 	}
-	format_header();
+	csv_format_header(&buf_csv);
 	return 0;
 }
 
-
 void csv_format_file(const struct fiducial_data *fid)
 {
-	register unsigned int i;
-	
-	format_data(fp_csv, "%lf,", fid->rec_time);
-	format_data(fp_csv, "%04d/%02d/%02d,", fid->zda.utc.tm_year, 
-						fid->zda.utc.tm_mon, fid->zda.utc.tm_mday);	
-	format_data(fp_csv, "%02d:%02d:%04.2f,", fid->gga.hours,
-						fid->gga.minutes, fid->gga.seconds);
-	format_data(fp_csv, "%7.4lf,", fid->gga.latitude);
-	format_data(fp_csv, "%7.4lf,", fid->gga.longitude);			
-	format_data(fp_csv, "%.2f,", fid->gga.altitude);
-	format_data(fp_csv, "%i,", fid->gga.fix);
-	format_data(fp_csv, "%d,", fid->gga.nsat);
-	format_data(fp_csv, "%.1f,", fid->gga.hdop);					
-	format_data(fp_csv, "%.1f,", fid->ral.agl_height);
-	format_data(fp_csv, "%d,", fid->line.line_nr);
-	format_data(fp_csv, "%.2lf,", fid->bar.pressure);
-	format_data(fp_csv, "%.2lf,%.2lf,", fid->trm.temperature, fid->hum.humidity);		
-	format_data(fp_csv, ",,");
-	format_data(fp_csv, "%ld,", fid->rsx.rsx_time);		
-    		
-	for (i = 0; i < NR_CRYSTALS; i++)
-		format_data(fp_csv, "%c,", fid->rsx.crystal_labels[i]);
-    		
-	for (i = 0; i < NR_CRYSTALS; i++)
-		format_data(fp_csv, "%d,", fid->rsx.crystal_error_flags[i]);
-
-	format_data(fp_csv, "%ld,", fid->rsx.vd_dn.acq_time);
-	format_data(fp_csv, "%ld,", fid->rsx.vd_up.acq_time);			
-	format_data(fp_csv, "%ld,", fid->rsx.vd_dn.live_time);
-	format_data(fp_csv, "%ld,", fid->rsx.vd_up.live_time);			
-	format_data(fp_csv, "%d,", fid->rsx.vd_dn.total_gamma_count);
-	format_data(fp_csv, "%d,", fid->rsx.vd_up.total_gamma_count);
-	
-	//for (i = 0; i < NR_CHANNELS; i++)
-		//format_data(fp_csv, "%d,", fid->rsx.vd_dn.spectrum[i]);
-	//for (i = 0; i < NR_CHANNELS; i++)
-		//format_data(fp_csv, "%d,", fid->rsx.vd_up.spectrum[i]);
-	
-	format_data(fp_csv, "\n");												
+	if (fp_csv == NULL)
+		return;
+
+	csv_format_row(&buf_csv, fid);
+	if (buf_csv.len >= CSV_FLUSH_SIZE)
+		flush_csv();
 }
 
 void csv_close_file(void)
 {
+	if (fp_csv == NULL)
+		return;
+
+	flush_csv();
 	fclose(fp_csv);
 	fp_csv = NULL;
+	csv_buffer_free(&buf_csv);
 }
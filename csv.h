@@ -1,8 +1,22 @@
 #ifndef CSV_H_INCLUDED
 #define CSV_H_INCLUDED
 
+#include <stddef.h>
+
 struct fiducial_data;
 
+/* Growable memory buffer rows are formatted into. */
+struct csv_buffer {
+	char *data;
+	size_t len;
+	size_t size;
+};
+
+extern int csv_buffer_reserve(struct csv_buffer *buf, size_t extra);
+extern void csv_buffer_free(struct csv_buffer *buf);
+extern void csv_format_header(struct csv_buffer *buf);
+extern void csv_format_row(struct csv_buffer *buf, const struct fiducial_data *fid);
+
 extern int csv_open_file(const char *filename);
 extern void csv_close_file(void);
 extern void csv_format_file(const struct fiducial_data *fid);
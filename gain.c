@@ -0,0 +1,271 @@
+#include <math.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "gain.h"
+#include "parse.h"
+#include "debug.h"
+#include "correct.h"
+
+#define K40_KEV				1460.8
+#define TH208_KEV			2614.5
+#define SEARCH_WIDTH		0.08	/* relative half width of peak search region */
+#define MIN_PEAK_COUNTS		200		/* net counts needed for a usable peak */
+
+static struct {
+	FILE *fp;
+	unsigned int window;			/* seconds per fit */
+	int rebin;						/* re-bin spectra to target calibration */
+	int calibrated;					/* gain and offset hold a fitted value */
+	double target_gain;				/* keV per channel to re-bin to */
+	double target_offset;
+	double gain;					/* latest fitted keV per channel */
+	double offset;
+	int have_frame;					/* raw spectra hold a decoded frame */
+	double frame_time;				/* rsx.prev_timestamp of that frame */
+	unsigned int raw_dn[NR_CHANNELS];	/* spectra as decoded, before re-binning */
+	unsigned int raw_up[NR_CHANNELS];
+	unsigned int *ring;				/* last window frames of spectra */
+	double *ring_time;
+	unsigned long sum[NR_CHANNELS];	/* sum of spectra in the ring */
+	unsigned int head;
+	unsigned int filled;
+	unsigned long seconds;
+} gain;
+
+/*
+ * Net peak centroid in channel coordinates (channel i spans [i, i + 1)).
+ * A linear background through the search region edges is removed and
+ * a Gaussian is fitted as a weighted parabola to the logarithm of the
+ * counts above half maximum. Returns -1 if no usable peak is found.
+ */
+static int fit_peak(double kev, double *centroid)
+{
+	double expected = (kev - gain.offset) / gain.gain;
+	int lo = floor(expected * (1.0 - SEARCH_WIDTH));
+	int hi = ceil(expected * (1.0 + SEARCH_WIDTH));
+	double bl, br, best, ymax, net = 0.0;
+	double s0 = 0, s1 = 0, s2 = 0, s3 = 0, s4 = 0, t0 = 0, t1 = 0, t2 = 0;
+	double det, b, c;
+	int n, i, l, r, peak = 0;
+
+	if (lo < 0)
+		lo = 0;
+	if (hi > NR_CHANNELS - 1)
+		hi = NR_CHANNELS - 1;
+	n = hi - lo + 1;
+	if (n < 12)
+		return -1;
+
+	{
+		double y[n];
+
+		bl = (gain.sum[lo] + gain.sum[lo + 1] + gain.sum[lo + 2]) / 3.0;
+		br = (gain.sum[hi] + gain.sum[hi - 1] + gain.sum[hi - 2]) / 3.0;
+		for (i = 0; i < n; i++)
+			y[i] = gain.sum[lo + i] - (bl + (br - bl) * i / (n - 1));
+
+		/* Maximum of the 3 channel running sum locates the peak */
+		for (i = 1, best = -HUGE_VAL; i < n - 1; i++) {
+			if (y[i - 1] + y[i] + y[i + 1] > best) {
+				best = y[i - 1] + y[i] + y[i + 1];
+				peak = i;
+			}
+		}
+		ymax = y[peak];
+		if (ymax <= 0)
+			return -1;
+
+		for (l = peak; l > 0 && y[l - 1] > ymax / 2; l--)
+			;
+		for (r = peak; r < n - 1 && y[r + 1] > ymax / 2; r++)
+			;
+		if (r - l < 2)
+			return -1;
+
+		for (i = l; i <= r; i++) {
+			double x = i - peak, w = y[i] * y[i], ly = log(y[i]);
+
+			net += y[i];
+			s0 += w;
+			s1 += w * x;
+			s2 += w * x * x;
+			s3 += w * x * x * x;
+			s4 += w * x * x * x * x;
+			t0 += w * ly;
+			t1 += w * x * ly;
+			t2 += w * x * x * ly;
+		}
+		if (net < MIN_PEAK_COUNTS)
+			return -1;
+
+		/* Cramer's rule on the normal equations of ln y = a + b x + c x^2 */
+		det = s0 * (s2 * s4 - s3 * s3) - s1 * (s1 * s4 - s2 * s3) + s2 * (s1 * s3 - s2 * s2);
+		if (fabs(det) > 0) {
+			b = (s0 * (t1 * s4 - s3 * t2) - t0 * (s1 * s4 - s2 * s3) + s2 * (s1 * t2 - t1 * s2)) / det;
+			c = (s0 * (s2 * t2 - t1 * s3) - s1 * (s1 * t2 - t1 * s2) + t0 * (s1 * s3 - s2 * s2)) / det;
+			if (c < 0 && -b / (2 * c) >= l - peak && -b / (2 * c) <= r - peak) {
+				*centroid = lo + peak - b / (2 * c) + 0.5;
+				return 0;
+			}
+		}
+
+		/* Fall back to the plain centroid of the peak region */
+		for (i = l, s1 = 0; i <= r; i++)
+			s1 += y[i] * i;
+		*centroid = lo + s1 / net + 0.5;
+	}
+	return 0;
+}
+
+static void fit_window(double rec_time)
+{
+	double ck = 0, cth = 0;
+	double window_start = gain.ring_time[gain.head];
+
+	if (fit_peak(K40_KEV, &ck) == 0 && fit_peak(TH208_KEV, &cth) == 0 && cth > ck) {
+		double g = (TH208_KEV - K40_KEV) / (cth - ck);
+
+		/* Reject fits too far from the nominal calibration */
+		if (g > 0.5 * gain.target_gain && g < 2.0 * gain.target_gain) {
+			gain.gain = g;
+			gain.offset = K40_KEV - g * ck;
+			gain.calibrated = 1;
+			fprintf(gain.fp, "%lf,%lf,%.2f,%.2f,%.5f,%.2f,\n", rec_time,
+					window_start, ck, cth, gain.gain, gain.offset);
+			return;
+		}
+	}
+	fprintf(gain.fp, "%lf,%lf,,,,,\n", rec_time, window_start);
+}
+
+/* Re-bin a spectrum from the fitted to the target calibration keeping its total. */
+static void rebin_spectrum(unsigned int *spec)
+{
+	double out[NR_CHANNELS];
+	double scale = gain.gain / gain.target_gain;
+	double shift = (gain.offset - gain.target_offset) / gain.target_gain;
+	double acc = 0.0;
+	unsigned long prev = 0;
+	register int i, k;
+
+	memset(out, 0, sizeof(out));
+	for (i = 0; i < NR_CHANNELS; i++) {
+		double t0 = shift + scale * i;
+		double t1 = t0 + scale;
+		double density = spec[i] / scale;
+
+		if (spec[i] == 0)
+			continue;
+		for (k = floor(t0); k < t1; k++) {
+			double from = t0 > k ? t0 : k;
+			double to = t1 < k + 1 ? t1 : k + 1;
+
+			if (k < 0)
+				continue;
+			out[k < NR_CHANNELS ? k : NR_CHANNELS - 1] += density * (to - from);
+		}
+	}
+
+	for (i = 0; i < NR_CHANNELS; i++) {
+		unsigned long total;
+
+		acc += out[i];
+		total = floor(acc + 0.5);
+		spec[i] = total - prev;
+		prev = total;
+	}
+}
+
+int gain_open_file(const char *filename, unsigned int window, int rebin,
+					const struct correct_coeffs *coeffs)
+{
+	if (filename == NULL || coeffs == NULL || window == 0)
+		return -1;
+
+	memset(&gain, 0, sizeof(gain));
+	gain.window = window;
+	gain.rebin = rebin;
+	gain.target_gain = gain.gain = coeffs->kev_per_channel;
+	gain.target_offset = gain.offset = coeffs->kev_offset;
+
+	gain.ring = calloc((size_t)window * NR_CHANNELS, sizeof(*gain.ring));
+	gain.ring_time = calloc(window, sizeof(*gain.ring_time));
+	if (gain.ring == NULL || gain.ring_time == NULL) {
+		DEBUG("Out of memory.");
+		goto error;
+	}
+
+	gain.fp = fopen(filename, "w");
+	if (gain.fp == NULL) {
+		DEBUG("Failed to open file: %s", filename);
+		goto error;
+	}
+	fprintf(gain.fp, "%s", "REC_TIME,WINDOW_START,K_PEAK_CH,TH_PEAK_CH,"
+							"GAIN_KEV,OFFSET_KEV,\n");
+	return 0;
+
+error:
+	free(gain.ring);
+	free(gain.ring_time);
+	memset(&gain, 0, sizeof(gain));
+	return -1;
+}
+
+/*
+ * The fiducial keeps its spectra across seconds without a new RSX frame,
+ * and re-binning overwrites them. Only newly decoded frames go into the
+ * ring, and they are kept raw so that each second is re-binned from the
+ * frame as decoded.
+ */
+void gain_push(struct fiducial_data *fid)
+{
+	unsigned int *slot;
+	register unsigned int j;
+
+	if (gain.fp == NULL)
+		return;
+
+	if (fid->rsx.seen && (!gain.have_frame || fid->rsx.prev_timestamp != gain.frame_time)) {
+		memcpy(gain.raw_dn, fid->rsx.vd_dn.spectrum, sizeof(gain.raw_dn));
+		memcpy(gain.raw_up, fid->rsx.vd_up.spectrum, sizeof(gain.raw_up));
+		gain.frame_time = fid->rsx.prev_timestamp;
+		gain.have_frame = 1;
+
+		/* Replace the oldest frame in the running sum with this one */
+		slot = &gain.ring[(size_t)gain.head * NR_CHANNELS];
+		for (j = 0; j < NR_CHANNELS; j++) {
+			unsigned int v = gain.raw_dn[j] + gain.raw_up[j];
+
+			gain.sum[j] = gain.sum[j] + v - slot[j];
+			slot[j] = v;
+		}
+		gain.ring_time[gain.head] = fid->rec_time;
+		gain.head = (gain.head + 1) % gain.window;
+		if (gain.filled < gain.window)
+			gain.filled++;
+
+		if (gain.filled == gain.window && ++gain.seconds % GAIN_STEP == 0)
+			fit_window(fid->rec_time);
+	}
+
+	if (gain.rebin && gain.calibrated && gain.have_frame) {
+		memcpy(fid->rsx.vd_dn.spectrum, gain.raw_dn, sizeof(gain.raw_dn));
+		memcpy(fid->rsx.vd_up.spectrum, gain.raw_up, sizeof(gain.raw_up));
+		rebin_spectrum(fid->rsx.vd_dn.spectrum);
+		rebin_spectrum(fid->rsx.vd_up.spectrum);
+	}
+}
+
+void gain_close_file(void)
+{
+	if (gain.fp == NULL)
+		return;
+
+	fclose(gain.fp);
+	free(gain.ring);
+	free(gain.ring_time);
+	memset(&gain, 0, sizeof(gain));
+}
@@ -0,0 +1,15 @@
+#ifndef GAIN_H_INCLUDED
+#define GAIN_H_INCLUDED
+
+struct fiducial_data;
+struct correct_coeffs;
+
+#define GAIN_WINDOW			60		/* seconds of spectra per fit */
+#define GAIN_STEP			10		/* seconds between fits */
+
+extern int gain_open_file(const char *filename, unsigned int window, int rebin,
+							const struct correct_coeffs *coeffs);
+extern void gain_close_file(void);
+extern void gain_push(struct fiducial_data *fid);
+
+#endif	/* GAIN_H_INCLUDED */
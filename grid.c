@@ -0,0 +1,343 @@
+#include <math.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "grid.h"
+#include "parse.h"
+#include "debug.h"
+#include "correct.h"
+#include "parallel.h"
+
+#define TILE_SIZE			64			/* cells per tile side */
+#define MAX_CELLS			(1UL << 30)
+#define SMOOTHING			0.01		/* keeps the weight finite at a point */
+#define MIN_KX				0.05		/* bounds the x search radius near the poles */
+
+struct grid_point {
+	double x;					/* longitude */
+	double y;					/* latitude */
+	float v;
+};
+
+struct grid_tile {
+	double wv[TILE_SIZE * TILE_SIZE];	/* sum of weighted values */
+	double w[TILE_SIZE * TILE_SIZE];	/* sum of weights */
+};
+
+/*
+ * Every thread accumulates its share of the points into a private
+ * raster. Tiles are only allocated where the thread has touched the
+ * raster, so a thread working on one end of a survey block does not
+ * pay for the other end.
+ */
+struct grid_task {
+	unsigned long first;		/* first point, or tile when merging */
+	unsigned long last;
+	struct grid_tile **tiles;
+	int failed;
+};
+
+static struct {
+	FILE *fp;
+	double cell;
+	grid_value_t value;
+	struct correct_coeffs coeffs;
+	unsigned int nr_threads;
+	struct grid_point *points;
+	unsigned long nr_points;
+	unsigned long max_points;
+	double xmin, xmax, ymin, ymax;
+	double x0, y0;				/* south west cell centre */
+	double kx;					/* longitude to latitude distance ratio */
+	unsigned int rx;			/* search radius in cells along x */
+	unsigned int nx, ny;
+	unsigned int ntx, nty;
+	struct grid_task *tasks;
+} grid;
+
+static void *accumulate_worker(void *arg)
+{
+	struct grid_task *t = arg;
+	const double r2 = GRID_RADIUS * GRID_RADIUS;
+	register unsigned long p;
+
+	for (p = t->first; p < t->last; p++) {
+		const struct grid_point *pt = &grid.points[p];
+		double cx = (pt->x - grid.x0) / grid.cell;
+		double cy = (pt->y - grid.y0) / grid.cell;
+		int i0 = ceil(cx - grid.rx), i1 = floor(cx + grid.rx);
+		int j0 = ceil(cy - GRID_RADIUS), j1 = floor(cy + GRID_RADIUS);
+		int i, j;
+
+		for (j = j0 < 0 ? 0 : j0; j <= j1 && j < (int)grid.ny; j++) {
+			double dy2 = (j - cy) * (j - cy);
+
+			for (i = i0 < 0 ? 0 : i0; i <= i1 && i < (int)grid.nx; i++) {
+				double dx = (i - cx) * grid.kx;
+				double d2 = dx * dx + dy2, w;
+				unsigned long tile = (j / TILE_SIZE) * grid.ntx + i / TILE_SIZE;
+				unsigned int cell = (j % TILE_SIZE) * TILE_SIZE + i % TILE_SIZE;
+
+				if (d2 > r2)
+					continue;
+
+				if (t->tiles[tile] == NULL) {
+					t->tiles[tile] = calloc(1, sizeof(struct grid_tile));
+					if (t->tiles[tile] == NULL) {
+						t->failed = 1;
+						return NULL;
+					}
+				}
+
+				/* Inverse distance squared weighting */
+				w = 1.0 / (d2 + SMOOTHING);
+				t->tiles[tile]->wv[cell] += w * pt->v;
+				t->tiles[tile]->w[cell] += w;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Folds every thread's tiles in [first, last) into the first thread's raster. */
+static void *merge_worker(void *arg)
+{
+	const struct grid_task *t = arg;
+	struct grid_tile **dst = grid.tasks[0].tiles;
+	register unsigned long tile;
+	register unsigned int i, c;
+
+	for (tile = t->first; tile < t->last; tile++) {
+		for (i = 1; i < grid.nr_threads; i++) {
+			struct grid_tile *src = grid.tasks[i].tiles[tile];
+
+			if (src == NULL)
+				continue;
+			if (dst[tile] == NULL) {
+				dst[tile] = src;
+			} else {
+				for (c = 0; c < TILE_SIZE * TILE_SIZE; c++) {
+					dst[tile]->wv[c] += src->wv[c];
+					dst[tile]->w[c] += src->w[c];
+				}
+				free(src);
+			}
+			grid.tasks[i].tiles[tile] = NULL;
+		}
+	}
+	return NULL;
+}
+
+static void split_range(unsigned long n)
+{
+	unsigned long per_thread = (n + grid.nr_threads - 1) / grid.nr_threads;
+	register unsigned int i;
+
+	for (i = 0; i < grid.nr_threads; i++) {
+		grid.tasks[i].first = i * per_thread < n ? i * per_thread : n;
+		grid.tasks[i].last = grid.tasks[i].first + per_thread < n ?
+								grid.tasks[i].first + per_thread : n;
+	}
+}
+
+static int write_grid(void)
+{
+	struct grid_tile **tiles = grid.tasks ? grid.tasks[0].tiles : NULL;
+	uint32_t version = 1, nx = grid.nx, ny = grid.ny;
+	float nodata = GRID_NODATA;
+	float *row = NULL;
+	register unsigned int i, j;
+	int ret = 0;
+
+	row = malloc(sizeof(*row) * grid.nx + 1);
+	if (row == NULL) {
+		DEBUG("Out of memory.");
+		return -1;
+	}
+
+	fwrite("AGDG", 4, 1, grid.fp);
+	fwrite(&version, sizeof(version), 1, grid.fp);
+	fwrite(&nx, sizeof(nx), 1, grid.fp);
+	fwrite(&ny, sizeof(ny), 1, grid.fp);
+	fwrite(&grid.x0, sizeof(grid.x0), 1, grid.fp);
+	fwrite(&grid.y0, sizeof(grid.y0), 1, grid.fp);
+	fwrite(&grid.cell, sizeof(grid.cell), 1, grid.fp);
+	fwrite(&nodata, sizeof(nodata), 1, grid.fp);
+
+	for (j = 0; j < grid.ny; j++) {
+		for (i = 0; i < grid.nx; i++) {
+			const struct grid_tile *tile = tiles[(j / TILE_SIZE) * grid.ntx + i / TILE_SIZE];
+			unsigned int cell = (j % TILE_SIZE) * TILE_SIZE + i % TILE_SIZE;
+
+			row[i] = tile && tile->w[cell] > 0 ? tile->wv[cell] / tile->w[cell] : nodata;
+		}
+		if (fwrite(row, sizeof(*row) * grid.nx, 1, grid.fp) != 1) {
+			DEBUG("Failed to write grid row %u.", j);
+			ret = -1;
+			break;
+		}
+	}
+	free(row);
+	return ret;
+}
+
+static int grid_process(void)
+{
+	unsigned long nr_tiles;
+	register unsigned int i;
+	register unsigned long t;
+	int ret = -1;
+
+	/* A cell is narrower than tall away from the equator, the radius covers more of them */
+	grid.kx = cos((grid.ymin + grid.ymax) / 2 * M_PI / 180.0);
+	if (grid.kx < MIN_KX)
+		grid.kx = MIN_KX;
+	grid.rx = ceil(GRID_RADIUS / grid.kx);
+
+	grid.x0 = grid.xmin - grid.rx * grid.cell;
+	grid.y0 = grid.ymin - GRID_RADIUS * grid.cell;
+	grid.nx = ceil((grid.xmax - grid.xmin) / grid.cell) + 2 * grid.rx + 1;
+	grid.ny = ceil((grid.ymax - grid.ymin) / grid.cell) + 2 * GRID_RADIUS + 1;
+	if ((unsigned long)grid.nx * grid.ny > MAX_CELLS) {
+		DEBUG("Grid of %u x %u cells is too large, increase the cell size.",
+			grid.nx, grid.ny);
+		return -1;
+	}
+	grid.ntx = (grid.nx + TILE_SIZE - 1) / TILE_SIZE;
+	grid.nty = (grid.ny + TILE_SIZE - 1) / TILE_SIZE;
+	nr_tiles = (unsigned long)grid.ntx * grid.nty;
+
+	grid.tasks = calloc(grid.nr_threads, sizeof(*grid.tasks));
+	if (grid.tasks == NULL) {
+		DEBUG("Out of memory.");
+		return -1;
+	}
+	for (i = 0; i < grid.nr_threads; i++) {
+		grid.tasks[i].tiles = calloc(nr_tiles, sizeof(struct grid_tile *));
+		if (grid.tasks[i].tiles == NULL) {
+			DEBUG("Out of memory.");
+			goto out;
+		}
+	}
+
+	split_range(grid.nr_points);
+	if (parallel_run(accumulate_worker, grid.tasks, sizeof(*grid.tasks),
+						grid.nr_threads) != 0) {
+		DEBUG("Grid worker failed.");
+		goto out;
+	}
+	for (i = 0; i < grid.nr_threads; i++) {
+		if (grid.tasks[i].failed) {
+			DEBUG("Out of memory.");
+			goto out;
+		}
+	}
+
+	split_range(nr_tiles);
+	if (parallel_run(merge_worker, grid.tasks, sizeof(*grid.tasks),
+						grid.nr_threads) != 0) {
+		DEBUG("Grid worker failed.");
+		goto out;
+	}
+	ret = write_grid();
+
+out:
+	for (i = 0; i < grid.nr_threads; i++) {
+		for (t = 0; grid.tasks[i].tiles && t < nr_tiles; t++)
+			free(grid.tasks[i].tiles[t]);
+		free(grid.tasks[i].tiles);
+	}
+	free(grid.tasks);
+	grid.tasks = NULL;
+	return ret;
+}
+
+int grid_open_file(const char *filename, double cell, grid_value_t value,
+					const struct correct_coeffs *coeffs,
+					unsigned int nr_threads)
+{
+	if (filename == NULL || coeffs == NULL || cell <= 0)
+		return -1;
+
+	memset(&grid, 0, sizeof(grid));
+	grid.cell = cell;
+	grid.value = value;
+	grid.coeffs = *coeffs;
+	grid.nr_threads = nr_threads ? nr_threads : 1;
+	grid.xmin = grid.ymin = HUGE_VAL;
+	grid.xmax = grid.ymax = -HUGE_VAL;
+
+	grid.fp = fopen(filename, "wb");
+	if (grid.fp == NULL) {
+		DEBUG("Failed to open file: %s", filename);
+		return -1;
+	}
+	return 0;
+}
+
+void grid_push(const struct fiducial_data *fid)
+{
+	struct grid_point *pt;
+	double rates[NR_WINDOWS];
+
+	if (grid.fp == NULL || fid->gga.fix == FIX_INVALID)
+		return;
+
+	if (grid.nr_points == grid.max_points) {
+		unsigned long max = grid.max_points ? 2 * grid.max_points : 4096;
+		struct grid_point *tmp = realloc(grid.points, max * sizeof(*tmp));
+
+		if (tmp == NULL) {
+			DEBUG("Out of memory, fiducial at %lf not gridded.", fid->rec_time);
+			return;
+		}
+		grid.points = tmp;
+		grid.max_points = max;
+	}
+
+	pt = &grid.points[grid.nr_points++];
+	pt->x = fid->gga.longitude_hemisphere == 'W' ? -fid->gga.longitude : fid->gga.longitude;
+	pt->y = fid->gga.latitude_hemisphere == 'S' ? -fid->gga.latitude : fid->gga.latitude;
+
+	if (grid.value == GRID_TOTAL_COUNT) {
+		pt->v = fid->rsx.vd_dn.total_gamma_count;
+	} else {
+		correct_window_rates(fid, &grid.coeffs, rates);
+		pt->v = rates[WIN_TC + grid.value - GRID_RATE_TC];
+	}
+
+	if (pt->x < grid.xmin)
+		grid.xmin = pt->x;
+	if (pt->x > grid.xmax)
+		grid.xmax = pt->x;
+	if (pt->y < grid.ymin)
+		grid.ymin = pt->y;
+	if (pt->y > grid.ymax)
+		grid.ymax = pt->y;
+}
+
+int grid_close_file(void)
+{
+	int ret = 0;
+
+	if (grid.fp == NULL)
+		return -1;
+
+	if (grid.nr_points > 0) {
+		ret = grid_process();
+	} else {
+		/* Valid grid of no cells, no fiducial had a position */
+		DEBUG("No positioned fiducials, empty grid written.");
+		grid.x0 = grid.y0 = 0.0;
+		grid.nx = grid.ny = 0;
+		ret = write_grid();
+	}
+
+	free(grid.points);
+	fclose(grid.fp);
+	memset(&grid, 0, sizeof(grid));
+	return ret;
+}
@@ -0,0 +1,37 @@
+#ifndef GRID_H_INCLUDED
+#define GRID_H_INCLUDED
+
+struct fiducial_data;
+struct correct_coeffs;
+
+#define GRID_CELL			0.001		/* default cell size in degrees */
+#define GRID_RADIUS			3			/* search radius, in cells of latitude */
+#define GRID_NODATA			-99999.0f
+
+/* Quantity gridded for every fiducial. */
+typedef enum grid_value_t {
+	GRID_TOTAL_COUNT = 0,	/* RSX down total gamma count */
+	GRID_RATE_TC,			/* Window count rates */
+	GRID_RATE_K,
+	GRID_RATE_U,
+	GRID_RATE_TH,
+} grid_value_t;
+
+/*
+ * Binary grid file layout, native byte order:
+ *   char     magic[4]   "AGDG"
+ *   uint32   version    1
+ *   uint32   nx, ny     number of columns and rows
+ *   double   x0, y0     longitude and latitude of the south west cell centre
+ *   double   cell       cell size in degrees
+ *   float    nodata     value of cells without data
+ * followed by ny rows of nx floats, south row first. nx and ny are 0
+ * when no fiducial had a position.
+ */
+extern int grid_open_file(const char *filename, double cell, grid_value_t value,
+							const struct correct_coeffs *coeffs,
+							unsigned int nr_threads);
+extern void grid_push(const struct fiducial_data *fid);
+extern int grid_close_file(void);
+
+#endif	/* GRID_H_INCLUDED */
@@ -0,0 +1,521 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "csv.h"
+#include "pool.h"
+#include "parse.h"
+#include "debug.h"
+#include "ingest.h"
+#include "summary.h"
+
+#define INGEST_PATH_MAX		1024
+#define INGEST_FLUSH_SIZE	(64 * 1024)
+#define INGEST_MANIFEST		"manifest.csv"
+
+void input_list_init(struct input_list *list)
+{
+	memset(list, 0, sizeof(*list));
+}
+
+void input_list_free(struct input_list *list)
+{
+	register unsigned long i;
+
+	for (i = 0; i < list->nr_files; i++) {
+		free(list->files[i].path);
+		free(list->files[i].name);
+	}
+	free(list->files);
+	memset(list, 0, sizeof(*list));
+}
+
+static int add_file(struct input_list *list, const char *path, const char *name,
+					long long size)
+{
+	struct input_file *in;
+
+	if (list->nr_files == list->max_files) {
+		unsigned long max = list->max_files ? 2 * list->max_files : 64;
+		struct input_file *tmp = realloc(list->files, max * sizeof(*tmp));
+
+		if (tmp == NULL) {
+			DEBUG("Out of memory.");
+			return -1;
+		}
+		list->files = tmp;
+		list->max_files = max;
+	}
+
+	in = &list->files[list->nr_files];
+	in->path = malloc(strlen(path) + 1);
+	in->name = malloc(strlen(name) + 1);
+	if (in->path == NULL || in->name == NULL) {
+		DEBUG("Out of memory.");
+		free(in->path);
+		free(in->name);
+		return -1;
+	}
+	strcpy(in->path, path);
+	strcpy(in->name, name);
+	in->size = size;
+	list->nr_files++;
+	return 0;
+}
+
+static int has_dat_suffix(const char *name)
+{
+	size_t len = strlen(name);
+
+	return len > 4 && name[len - 4] == '.' && tolower((unsigned char)name[len - 3]) == 'd' &&
+			tolower((unsigned char)name[len - 2]) == 'a' &&
+			tolower((unsigned char)name[len - 1]) == 't';
+}
+
+static int wildcard_match(const char *pat, const char *str)
+{
+	if (*pat == '\0')
+		return *str == '\0';
+	if (*pat == '*')
+		return wildcard_match(pat + 1, str) || (*str && wildcard_match(pat, str + 1));
+	if (*str && (*pat == '?' || *pat == *str))
+		return wildcard_match(pat + 1, str + 1);
+	return 0;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Adds the entries of a directory in name order. Without a pattern
+ * every .dat file is taken and subdirectories are descended into,
+ * with a pattern only matching entries of this directory are taken.
+ * Names are the paths below the directory given, prefixed by prefix.
+ */
+static int add_directory(struct input_list *list, const char *dir, const char *prefix,
+							const char *pattern)
+{
+	DIR *dp = NULL;
+	struct dirent *de;
+	char **names = NULL;
+	unsigned long nr_names = 0, max_names = 0, i;
+	int ret = 0;
+
+	dp = opendir(dir);
+	if (dp == NULL) {
+		DEBUG("Failed to open directory: %s", dir);
+		return -1;
+	}
+
+	while ((de = readdir(dp)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+		if (pattern && !wildcard_match(pattern, de->d_name))
+			continue;
+
+		if (nr_names == max_names) {
+			unsigned long max = max_names ? 2 * max_names : 64;
+			char **tmp = realloc(names, max * sizeof(*tmp));
+
+			if (tmp == NULL) {
+				DEBUG("Out of memory.");
+				ret = -1;
+				break;
+			}
+			names = tmp;
+			max_names = max;
+		}
+		names[nr_names] = malloc(strlen(de->d_name) + 1);
+		if (names[nr_names] == NULL) {
+			DEBUG("Out of memory.");
+			ret = -1;
+			break;
+		}
+		strcpy(names[nr_names++], de->d_name);
+	}
+	closedir(dp);
+
+	if (nr_names)
+		qsort(names, nr_names, sizeof(*names), compare_names);
+
+	for (i = 0; i < nr_names; i++) {
+		char path[INGEST_PATH_MAX], name[INGEST_PATH_MAX];
+		struct stat st;
+
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]);
+		snprintf(name, sizeof(name), "%s%s", prefix, names[i]);
+		free(names[i]);
+		if (ret != 0 || stat(path, &st) != 0)
+			continue;
+
+		if (S_ISDIR(st.st_mode)) {
+			strncat(name, "/", sizeof(name) - strlen(name) - 1);
+			if (pattern == NULL && add_directory(list, path, name, NULL) != 0)
+				ret = -1;
+		} else if (S_ISREG(st.st_mode) && (pattern || has_dat_suffix(path))) {
+			if (add_file(list, path, name, st.st_size) != 0)
+				ret = -1;
+		}
+	}
+	free(names);
+	return ret;
+}
+
+/* Adds a file, every .dat file below a directory or the files matching a pattern. */
+int input_list_add(struct input_list *list, const char *path)
+{
+	const char *base = strrchr(path, '/');
+	struct stat st;
+
+	base = base ? base + 1 : path;
+	if (strpbrk(base, "*?")) {
+		char dir[INGEST_PATH_MAX];
+		unsigned long nr_files = list->nr_files;
+
+		if (base == path) {
+			strcpy(dir, ".");
+		} else {
+			snprintf(dir, sizeof(dir), "%.*s", (int)(base - path - 1), path);
+			if (dir[0] == '\0')
+				strcpy(dir, "/");
+		}
+		if (add_directory(list, dir, "", base) != 0)
+			return -1;
+		if (list->nr_files == nr_files) {
+			DEBUG("No files match: %s", path);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (stat(path, &st) != 0) {
+		/* Kept so that the failure is reported along with the rest */
+		DEBUG("Failed to stat file: %s", path);
+		errno = 0;
+		return add_file(list, path, base, 0);
+	}
+
+	if (S_ISDIR(st.st_mode))
+		return add_directory(list, path, "", NULL);
+	return add_file(list, path, base, st.st_size);
+}
+
+/* Manifest holds one input path per line, lines starting with '#' are comments. */
+int input_list_add_manifest(struct input_list *list, const char *filename)
+{
+	FILE *fp = NULL;
+	char buf[INGEST_PATH_MAX] = "";
+	int ret = 0;
+
+	if (filename == NULL)
+		return -1;
+
+	fp = fopen(filename, "r");
+	if (fp == NULL) {
+		DEBUG("Failed to open file: %s", filename);
+		return -1;
+	}
+
+	while (fgets(buf, sizeof(buf), fp)) {
+		size_t len = strcspn(buf, "\r\n");
+
+		buf[len] = '\0';
+		if (len == 0 || buf[0] == '#')
+			continue;
+		if (input_list_add(list, buf) != 0)
+			ret = -1;
+	}
+	fclose(fp);
+	return ret;
+}
+
+struct ingest_job {
+	const struct input_file *in;
+	char output[INGEST_PATH_MAX];
+	unsigned int nr;				/* output suffix when names clash, 1 is none */
+	const char *status;
+	unsigned long nr_fiducials;
+};
+
+struct ingest_run {
+	struct summary *summaries;		/* one per worker */
+};
+
+/* Per file output stream of a batch job. */
+struct ingest_stream {
+	FILE *fp;
+	struct csv_buffer buf;
+	struct summary summary;
+	unsigned long nr_fiducials;
+	int failed;
+};
+
+static void flush_stream(struct ingest_stream *s)
+{
+	if (s->buf.len > 0 && fwrite(s->buf.data, s->buf.len, 1, s->fp) != 1)
+		s->failed = 1;
+	s->buf.len = 0;
+}
+
+static void ingest_fiducial(struct fiducial_data *fid, void *arg)
+{
+	struct ingest_stream *s = arg;
+
+	summary_update(&s->summary, fid);
+	csv_format_row(&s->buf, fid);
+	s->nr_fiducials++;
+	if (s->buf.len >= INGEST_FLUSH_SIZE)
+		flush_stream(s);
+}
+
+static int make_dir(const char *path)
+{
+	int ret;
+
+#ifdef _WIN32
+	ret = mkdir(path);
+#else
+	ret = mkdir(path, 0755);
+#endif
+	if (ret != 0 && errno != EEXIST) {
+		DEBUG("Failed to create directory: %s", path);
+		return -1;
+	}
+	errno = 0;
+	return 0;
+}
+
+/* Creates the directories of an output path below outdir. */
+static void make_output_dirs(const char *output, size_t outdir_len)
+{
+	char path[INGEST_PATH_MAX];
+	char *p;
+
+	strcpy(path, output);
+	for (p = strchr(path + outdir_len + 1, '/'); p; p = strchr(p + 1, '/')) {
+		*p = '\0';
+		make_dir(path);
+		*p = '/';
+	}
+}
+
+/* The input name below outdir, with .dat replaced by .csv. */
+static void output_name(struct ingest_job *job, const char *outdir)
+{
+	const char *name = job->in->name;
+	size_t len = strlen(name);
+
+	if (has_dat_suffix(name))
+		len -= 4;
+	if (job->nr > 1)
+		snprintf(job->output, sizeof(job->output), "%s/%.*s_%u.csv", outdir,
+				(int)len, name, job->nr);
+	else
+		snprintf(job->output, sizeof(job->output), "%s/%.*s.csv", outdir, (int)len, name);
+}
+
+static int compare_job_output(const void *a, const void *b)
+{
+	const struct ingest_job *ja = *(struct ingest_job *const *)a;
+	const struct ingest_job *jb = *(struct ingest_job *const *)b;
+	int ret = strcmp(ja->output, jb->output);
+
+	/* Jobs are in input order, earlier inputs keep the plain name */
+	if (ret == 0)
+		ret = ja < jb ? -1 : ja > jb;
+	return ret;
+}
+
+/*
+ * Gives every job an output file of its own before any is scheduled.
+ * Inputs of the same name from different directories, or listed twice,
+ * get a numbered suffix, and the run manifest's name is never taken.
+ */
+static void unique_outputs(struct ingest_job **order, unsigned long nr_jobs,
+							const char *outdir)
+{
+	char manifest[INGEST_PATH_MAX];
+	register unsigned long i, k;
+	int clash;
+
+	snprintf(manifest, sizeof(manifest), "%s/%s", outdir, INGEST_MANIFEST);
+	do {
+		clash = 0;
+		for (i = 0; i < nr_jobs; i++) {
+			output_name(order[i], outdir);
+			if (!strcmp(order[i]->output, manifest)) {
+				order[i]->nr++;
+				clash = 1;
+			}
+		}
+		qsort(order, nr_jobs, sizeof(*order), compare_job_output);
+
+		for (i = 1, k = 1; i < nr_jobs; i++) {
+			if (strcmp(order[i]->output, order[i - 1]->output)) {
+				k = 1;
+				continue;
+			}
+			order[i]->nr += k++;
+			clash = 1;
+		}
+	} while (clash);
+}
+
+static void ingest_job(void *item, unsigned int worker, void *arg)
+{
+	struct ingest_job *job = item;
+	struct ingest_run *run = arg;
+	struct fiducial_data *fid = NULL;
+	struct ingest_stream s;
+
+	memset(&s, 0, sizeof(s));
+
+	fid = calloc(1, sizeof(*fid));
+	if (fid == NULL) {
+		job->status = "out of memory";
+		return;
+	}
+
+	s.fp = fopen(job->output, "w");
+	if (s.fp == NULL) {
+		DEBUG("Failed to open file: %s", job->output);
+		job->status = "output open failed";
+		free(fid);
+		return;
+	}
+	csv_format_header(&s.buf);
+	summary_init(&s.summary);
+
+	switch (parse_dat_file(job->in->path, fid, ingest_fiducial, &s)) {
+	case 0:
+		job->status = s.nr_fiducials ? "ok" : "no data";
+		break;
+	case DAT_TRUNCATED:
+		job->status = "truncated";
+		break;
+	default:
+		job->status = "input open failed";
+		break;
+	}
+
+	flush_stream(&s);
+	if (fclose(s.fp) != 0 || s.failed)
+		job->status = "write failed";
+	if (s.nr_fiducials == 0)
+		remove(job->output);
+	job->nr_fiducials = s.nr_fiducials;
+
+	summary_finish(&s.summary);
+	if (summary_merge(&run->summaries[worker], &s.summary) != 0)
+		DEBUG("Failed to merge summary of %s", job->in->path);
+	summary_free(&s.summary);
+	csv_buffer_free(&s.buf);
+	free(fid);
+}
+
+static int compare_job_size(const void *a, const void *b)
+{
+	const struct ingest_job *ja = *(struct ingest_job *const *)a;
+	const struct ingest_job *jb = *(struct ingest_job *const *)b;
+
+	if (ja->in->size != jb->in->size)
+		return ja->in->size > jb->in->size ? -1 : 1;
+	return 0;
+}
+
+static int write_manifest(const struct ingest_job *jobs, unsigned long nr_jobs,
+							const char *outdir)
+{
+	char path[INGEST_PATH_MAX];
+	FILE *fp = NULL;
+	register unsigned long i;
+
+	snprintf(path, sizeof(path), "%s/%s", outdir, INGEST_MANIFEST);
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		DEBUG("Failed to open file: %s", path);
+		return -1;
+	}
+
+	fprintf(fp, "%s", "FILE,SIZE,STATUS,FIDUCIALS,OUTPUT,\n");
+	for (i = 0; i < nr_jobs; i++) {
+		const struct ingest_job *job = &jobs[i];
+
+		fprintf(fp, "%s,%lld,%s,%lu,%s,\n", job->in->path, job->in->size,
+				job->status, job->nr_fiducials, job->nr_fiducials ? job->output : "");
+	}
+	fclose(fp);
+	return 0;
+}
+
+/*
+ * Extracts every input into its own csv file in outdir on a work
+ * stealing pool, largest file first. A file that fails is recorded
+ * in the run manifest and the rest of the batch carries on. Returns
+ * the number of failed files, or -1 if the batch could not be run.
+ */
+long ingest_batch(const struct input_list *list, const char *outdir,
+					unsigned int nr_threads, struct summary *summary)
+{
+	struct ingest_job *jobs = NULL;
+	struct ingest_job **order = NULL;
+	struct ingest_run run;
+	long nr_failed = -1;
+	register unsigned long i;
+
+	if (list == NULL || outdir == NULL || summary == NULL)
+		return -1;
+
+	if (nr_threads == 0)
+		nr_threads = 1;
+
+	if (make_dir(outdir) != 0)
+		return -1;
+
+	run.summaries = calloc(nr_threads, sizeof(*run.summaries));
+	jobs = calloc(list->nr_files + 1, sizeof(*jobs));
+	order = calloc(list->nr_files + 1, sizeof(*order));
+	if (run.summaries == NULL || jobs == NULL || order == NULL) {
+		DEBUG("Out of memory.");
+		goto out;
+	}
+
+	for (i = 0; i < list->nr_files; i++) {
+		jobs[i].in = &list->files[i];
+		jobs[i].nr = 1;
+		jobs[i].status = "not run";
+		order[i] = &jobs[i];
+	}
+	unique_outputs(order, list->nr_files, outdir);
+	for (i = 0; i < list->nr_files; i++)
+		make_output_dirs(jobs[i].output, strlen(outdir));
+	qsort(order, list->nr_files, sizeof(*order), compare_job_size);
+
+	if (pool_run((void **)order, list->nr_files, nr_threads, ingest_job, &run) != 0)
+		DEBUG("Some of the batch workers failed.");
+
+	for (i = 0; i < nr_threads; i++) {
+		summary_merge(summary, &run.summaries[i]);
+		summary_free(&run.summaries[i]);
+	}
+
+	for (i = 0, nr_failed = 0; i < list->nr_files; i++) {
+		if (strcmp(jobs[i].status, "ok"))
+			nr_failed++;
+	}
+	if (write_manifest(jobs, list->nr_files, outdir) != 0)
+		nr_failed = -1;
+
+out:
+	free(run.summaries);
+	free(jobs);
+	free(order);
+	return nr_failed;
+}
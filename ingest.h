@@ -0,0 +1,27 @@
+#ifndef INGEST_H_INCLUDED
+#define INGEST_H_INCLUDED
+
+struct summary;
+
+struct input_file {
+	char *path;
+	char *name;			/* path relative to the directory it was found in */
+	long long size;
+};
+
+/* Input .dat files, in the order given. */
+struct input_list {
+	struct input_file *files;
+	unsigned long nr_files;
+	unsigned long max_files;
+};
+
+extern void input_list_init(struct input_list *list);
+extern void input_list_free(struct input_list *list);
+extern int input_list_add(struct input_list *list, const char *path);
+extern int input_list_add_manifest(struct input_list *list, const char *filename);
+
+extern long ingest_batch(const struct input_list *list, const char *outdir,
+							unsigned int nr_threads, struct summary *summary);
+
+#endif	/* INGEST_H_INCLUDED */
@@ -1,24 +1,384 @@
 #include <stdio.h>
+#include <errno.h>
 #include <string.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <unistd.h>
 
 #include "csv.h"
 #include "parse.h"
 #include "debug.h"
+#include "correct.h"
+#include "nasvd.h"
+#include "gain.h"
+#include "grid.h"
+#include "shard.h"
+#include "merge.h"
+#include "summary.h"
+#include "ingest.h"
+#include "schema.h"
 
-int main(int argc, char **argv) 
+struct agde_options {
+	const char *csv_file;		/* Raw fiducial output */
+	const char *bin_file;		/* Raw fiducial binary output */
+	const char *cor_file;		/* Corrected counts output */
+	const char *coeffs_file;	/* Correction coefficients */
+	const char *nasvd_file;		/* NASVD smoothed spectra output */
+	unsigned int nasvd_components;
+	const char *gain_file;		/* Gain drift output */
+	unsigned int gain_window;
+	int rebin;					/* Re-bin spectra to nominal calibration */
+	const char *grid_file;		/* Binary grid output */
+	double grid_cell;
+	grid_value_t grid_value;
+	const char *shard_dir;		/* Per line csv output directory */
+	int shard_by_date;
+	unsigned int shard_max_open;
+	int merge;					/* Merge overlapping inputs by time */
+	const char *summary_file;	/* Per line QC statistics */
+	const char *batch_dir;		/* Per file csv output directory */
+	const char *manifest_file;	/* List of input files */
+	unsigned int nr_threads;
+};
+
+/* State of one fiducial stream, handed to the fiducial handler. */
+struct agde_stream {
+	const struct agde_options *opts;
+	struct summary summary;
+};
+
+enum {
+	OPT_SUMMARY = 256,
+	OPT_BATCH,
+	OPT_MANIFEST,
+};
+
+static const struct option long_options[] = {
+	{ "summary", required_argument, NULL, OPT_SUMMARY },
+	{ "batch", required_argument, NULL, OPT_BATCH },
+	{ "manifest", required_argument, NULL, OPT_MANIFEST },
+	{ "help", no_argument, NULL, 'h' },
+	{ NULL, 0, NULL, 0 }
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [options] file.dat|dir|'pattern'...\n"
+			"  -o file   raw fiducial csv output (default: tmp.csv unless -L)\n"
+			"  -b file   write raw fiducials to a binary file\n"
+			"  -c file   write corrected counts to file\n"
+			"  -k file   load correction coefficients from file\n"
+			"  -n file   write NASVD smoothed down spectra to file\n"
+			"  -N count  number of NASVD components (default: %d)\n"
+			"  -g file   write gain drift tracking to file\n"
+			"  -w secs   gain fit window length (default: %d)\n"
+			"  -r        re-bin spectra to the nominal energy calibration (needs -g)\n"
+			"  -G file   grid fiducials onto a lat/lon raster in file\n"
+			"  -s deg    grid cell size in degrees (default: %g)\n"
+			"  -v value  gridded value: total, tc, k, u or th (default: total)\n"
+			"  -L dir    write one csv file per flight line into dir\n"
+			"  -D        shard per GPS date as well as per line\n"
+			"  -F count  maximum number of open shard files (default: %d)\n"
+			"  -m        merge overlapping input files into one time ordered stream\n"
+			"  -j count  number of worker threads (default: online cpus)\n"
+			"  --summary file  write per line QC statistics and data gaps to file\n"
+			"  --manifest file read input paths from file, one per line\n"
+			"  --batch dir     extract every input into its own csv file in dir\n",
+			prog, NASVD_COMPONENTS, GAIN_WINDOW, GRID_CELL, SHARD_MAX_OPEN);
+}
+
+static unsigned int nr_cpus(void)
+{
+#ifdef _SC_NPROCESSORS_ONLN
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 0)
+		return n;
+#endif
+	return 1;
+}
+
+static int parse_grid_value(const char *str, grid_value_t *value)
+{
+	static const char *names[] = { "total", "tc", "k", "u", "th" };
+	register unsigned int i;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (!strcmp(str, names[i])) {
+			*value = (grid_value_t)i;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/* Batch mode writes per file csv output only. */
+static int run_batch(const struct agde_options *opts, const struct input_list *inputs)
+{
+	struct summary total;
+	long nr_failed;
+
+	if (opts->csv_file || opts->bin_file || opts->cor_file || opts->nasvd_file || opts->gain_file ||
+			opts->grid_file || opts->shard_dir || opts->merge) {
+		ERROR("--batch can not be combined with -o, -b, -c, -n, -g, -G, -L or -m.");
+		return 1;
+	}
+
+	summary_init(&total);
+	nr_failed = ingest_batch(inputs, opts->batch_dir, opts->nr_threads, &total);
+	if (nr_failed < 0) {
+		ERROR("Failed to run batch into: %s", opts->batch_dir);
+		summary_free(&total);
+		return 1;
+	}
+	if (nr_failed > 0)
+		ERROR("%ld of %lu input files failed, see %s/manifest.csv",
+				nr_failed, inputs->nr_files, opts->batch_dir);
+
+	summary_print_gaps(&total, stdout);
+	if (opts->summary_file && summary_write(&total, opts->summary_file) != 0)
+		ERROR("Failed to write summary: %s", opts->summary_file);
+	summary_free(&total);
+	return nr_failed > 0;
+}
+
+static void handle_fiducial(struct fiducial_data *fid, void *arg)
+{
+	struct agde_stream *stream = arg;
+	const struct agde_options *opts = stream->opts;
+
+	summary_update(&stream->summary, fid);
+
+	/* Gain tracking may re-bin spectra, so it comes first */
+	if (opts->gain_file)
+		gain_push(fid);
+	if (opts->csv_file)
+		csv_format_file(fid);
+	if (opts->bin_file)
+		schema_push(fid);
+	if (opts->shard_dir)
+		shard_push(fid);
+	if (opts->cor_file)
+		correct_push(fid);
+	if (opts->nasvd_file)
+		nasvd_push(fid);
+	if (opts->grid_file)
+		grid_push(fid);
+}
+
+int main(int argc, char **argv)
 {
-	register int i;
+	register unsigned long i;
+	int opt, ret;
 	struct fiducial_data fid;
-	
+	struct correct_coeffs coeffs;
+	struct agde_options opts;
+	struct agde_stream stream;
+	struct summary total;
+	struct input_list inputs;
+
+	memset(&opts, 0, sizeof(opts));
+	opts.nasvd_components = NASVD_COMPONENTS;
+	opts.gain_window = GAIN_WINDOW;
+	opts.grid_cell = GRID_CELL;
+	opts.grid_value = GRID_TOTAL_COUNT;
+	opts.shard_max_open = SHARD_MAX_OPEN;
+
+	while ((opt = getopt_long(argc, argv, "o:b:c:k:n:N:g:w:rG:s:v:L:DF:mj:h",
+								long_options, NULL)) != -1) {
+		switch (opt) {
+		case 'o':
+			opts.csv_file = optarg;
+			break;
+		case 'b':
+			opts.bin_file = optarg;
+			break;
+		case 'c':
+			opts.cor_file = optarg;
+			break;
+		case 'k':
+			opts.coeffs_file = optarg;
+			break;
+		case 'n':
+			opts.nasvd_file = optarg;
+			break;
+		case 'N':
+			opts.nasvd_components = atoi(optarg);
+			break;
+		case 'g':
+			opts.gain_file = optarg;
+			break;
+		case 'w':
+			opts.gain_window = atoi(optarg);
+			break;
+		case 'r':
+			opts.rebin = 1;
+			break;
+		case 'G':
+			opts.grid_file = optarg;
+			break;
+		case 's':
+			opts.grid_cell = atof(optarg);
+			break;
+		case 'v':
+			if (parse_grid_value(optarg, &opts.grid_value) != 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'L':
+			opts.shard_dir = optarg;
+			break;
+		case 'D':
+			opts.shard_by_date = 1;
+			break;
+		case 'F':
+			opts.shard_max_open = atoi(optarg);
+			break;
+		case 'm':
+			opts.merge = 1;
+			break;
+		case 'j':
+			opts.nr_threads = atoi(optarg);
+			break;
+		case OPT_SUMMARY:
+			opts.summary_file = optarg;
+			break;
+		case OPT_BATCH:
+			opts.batch_dir = optarg;
+			break;
+		case OPT_MANIFEST:
+			opts.manifest_file = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (opts.nr_threads == 0)
+		opts.nr_threads = nr_cpus();
+
+	/* The calibration to re-bin from is fitted by the gain tracker */
+	if (opts.rebin && opts.gain_file == NULL) {
+		ERROR("-r needs the gain tracking output -g.");
+		return 1;
+	}
+
+	input_list_init(&inputs);
+	for (opt = optind; opt < argc; opt++) {
+		if (input_list_add(&inputs, argv[opt]) != 0)
+			ERROR("Failed to add input: %s", argv[opt]);
+	}
+	if (opts.manifest_file && input_list_add_manifest(&inputs, opts.manifest_file) != 0)
+		ERROR("Failed to read some of the manifest: %s", opts.manifest_file);
+
+	if (opts.batch_dir) {
+		ret = run_batch(&opts, &inputs);
+		input_list_free(&inputs);
+		return ret;
+	}
+
 	memset(&fid, 0, sizeof(fid));
-	
-	csv_open_file("tmp.csv");
-	
-	for (i = 1; i < argc; i++) {
-		DEBUG("Extracting file: %s", argv[i]);
-    	parse_dat_file(argv[i], &fid); 
+
+	if (opts.csv_file == NULL && opts.shard_dir == NULL)
+		opts.csv_file = "tmp.csv";
+
+	if (opts.csv_file && csv_open_file(opts.csv_file) != 0) {
+		ERROR("Failed to open output file: %s", opts.csv_file);
+		return 1;
+	}
+
+	if (opts.bin_file && schema_open_file(opts.bin_file) != 0) {
+		ERROR("Failed to open output file: %s", opts.bin_file);
+		return 1;
+	}
+
+	if (opts.shard_dir && shard_open(opts.shard_dir, opts.shard_by_date,
+										opts.shard_max_open, opts.nr_threads) != 0) {
+		ERROR("Failed to open shard directory: %s", opts.shard_dir);
+		return 1;
+	}
+
+	correct_default_coeffs(&coeffs);
+	if (opts.coeffs_file && correct_load_coeffs(opts.coeffs_file, &coeffs) != 0) {
+		ERROR("Failed to load coefficients: %s", opts.coeffs_file);
+		return 1;
 	}
+
+	if (opts.cor_file && correct_open_file(opts.cor_file, &coeffs) != 0) {
+		ERROR("Failed to open output file: %s", opts.cor_file);
+		return 1;
+	}
+
+	if (opts.gain_file && gain_open_file(opts.gain_file, opts.gain_window,
+											opts.rebin, &coeffs) != 0) {
+		ERROR("Failed to open output file: %s", opts.gain_file);
+		return 1;
+	}
+
+	if (opts.nasvd_file && nasvd_open_file(opts.nasvd_file, opts.nasvd_components,
+											opts.nr_threads) != 0) {
+		ERROR("Failed to open output file: %s", opts.nasvd_file);
+		return 1;
+	}
+
+	if (opts.grid_file && grid_open_file(opts.grid_file, opts.grid_cell, opts.grid_value,
+											&coeffs, opts.nr_threads) != 0) {
+		ERROR("Failed to open output file: %s", opts.grid_file);
+		return 1;
+	}
+
+	summary_init(&total);
+	stream.opts = &opts;
+
+	if (opts.merge && inputs.nr_files) {
+		char **paths = malloc(inputs.nr_files * sizeof(*paths));
+
+		if (paths == NULL) {
+			ERROR("Out of memory.");
+			return 1;
+		}
+		for (i = 0; i < inputs.nr_files; i++)
+			paths[i] = inputs.files[i].path;
+
+		summary_init(&stream.summary);
+		ret = merge_dat_files(paths, inputs.nr_files, &fid, handle_fiducial, &stream);
+		if (ret == DAT_TRUNCATED)
+			ERROR("Some of the input files end in a truncated RSX frame.");
+		else if (ret != 0)
+			ERROR("Failed to open some of the input files.");
+		summary_finish(&stream.summary);
+		summary_merge(&total, &stream.summary);
+		summary_free(&stream.summary);
+		free(paths);
+	} else {
+		for (i = 0; i < inputs.nr_files; i++) {
+			DEBUG("Extracting file: %s", inputs.files[i].path);
+			summary_init(&stream.summary);
+			if (parse_dat_file(inputs.files[i].path, &fid, handle_fiducial,
+								&stream) == DAT_TRUNCATED)
+				ERROR("Truncated RSX frame at the end of: %s", inputs.files[i].path);
+			summary_finish(&stream.summary);
+			summary_merge(&total, &stream.summary);
+			summary_free(&stream.summary);
+		}
+	}
+
+	summary_print_gaps(&total, stdout);
+	if (opts.summary_file && summary_write(&total, opts.summary_file) != 0)
+		ERROR("Failed to write summary: %s", opts.summary_file);
+	summary_free(&total);
+	input_list_free(&inputs);
+
+	if (opts.nasvd_file && nasvd_close_file() != 0)
+		ERROR("NASVD noise reduction failed.");
+	if (opts.grid_file && grid_close_file() != 0)
+		ERROR("Gridding failed.");
+	if (opts.shard_dir && shard_close() != 0)
+		ERROR("Failed to write some of the line shards.");
+	correct_close_file();
+	gain_close_file();
 	csv_close_file();
+	schema_close_file();
 	return 0;
 }
-
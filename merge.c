@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "merge.h"
+#include "parse.h"
+#include "debug.h"
+
+#define RECENT_RECORDS		16		/* records remembered for duplicate detection */
+
+/* An input file with its next, not yet merged, record. */
+struct merge_source {
+	struct dat_reader *rd;
+	unsigned int index;				/* position on the command line */
+	struct dat_record rec;
+};
+
+/* Recently merged records, duplicates from overlapping files show up close together. */
+struct merge_recent {
+	double timestamp[RECENT_RECORDS];
+	unsigned long hash[RECENT_RECORDS];
+	unsigned long rsx_time[RECENT_RECORDS];
+	unsigned int nr_lines;
+	unsigned int nr_frames;
+};
+
+static inline int source_before(const struct merge_source *a, const struct merge_source *b)
+{
+	if (a->rec.timestamp != b->rec.timestamp)
+		return a->rec.timestamp < b->rec.timestamp;
+	return a->index < b->index;
+}
+
+static void heap_down(struct merge_source **heap, unsigned int n, unsigned int i)
+{
+	for (;;) {
+		unsigned int l = 2 * i + 1, r = l + 1, min = i;
+		struct merge_source *tmp;
+
+		if (l < n && source_before(heap[l], heap[min]))
+			min = l;
+		if (r < n && source_before(heap[r], heap[min]))
+			min = r;
+		if (min == i)
+			return;
+		tmp = heap[i];
+		heap[i] = heap[min];
+		heap[min] = tmp;
+		i = min;
+	}
+}
+
+static unsigned long line_hash(const char *s)
+{
+	unsigned long h = 5381;
+
+	while (*s)
+		h = h * 33 + (unsigned char)*s++;
+	return h;
+}
+
+/*
+ * Identical RSX frames are recognised by their RSX time, other records
+ * by recording time and line contents.
+ */
+static int is_duplicate(struct merge_recent *recent, const struct dat_record *rec)
+{
+	register unsigned int i;
+
+	if (rec->has_frame) {
+		for (i = 0; i < RECENT_RECORDS && i < recent->nr_frames; i++) {
+			if (recent->rsx_time[i] == rec->rsx_time)
+				return 1;
+		}
+		recent->rsx_time[recent->nr_frames++ % RECENT_RECORDS] = rec->rsx_time;
+	} else {
+		unsigned long hash = line_hash(rec->line);
+
+		for (i = 0; i < RECENT_RECORDS && i < recent->nr_lines; i++) {
+			if (recent->timestamp[i] == rec->timestamp && recent->hash[i] == hash)
+				return 1;
+		}
+		recent->timestamp[recent->nr_lines % RECENT_RECORDS] = rec->timestamp;
+		recent->hash[recent->nr_lines++ % RECENT_RECORDS] = hash;
+	}
+	return 0;
+}
+
+/*
+ * Merges several recordings of one flight into a single time ordered
+ * fiducial stream. Every file is read as a stream, only the next
+ * record of each input is held in memory. Returns like parse_dat_file.
+ */
+int merge_dat_files(char *const *filenames, unsigned int nr_files,
+					struct fiducial_data *fid,
+					fiducial_handler_t handler, void *arg)
+{
+	struct merge_source *sources = NULL;
+	struct merge_source **heap = NULL;
+	struct merge_recent recent;
+	struct dat_parser parser;
+	unsigned long nr_dups = 0;
+	unsigned int i, n = 0;
+	int ret = 0;
+
+	if (filenames == NULL || handler == NULL || nr_files == 0)
+		return -1;
+
+	sources = calloc(nr_files, sizeof(*sources));
+	heap = calloc(nr_files, sizeof(*heap));
+	if (sources == NULL || heap == NULL) {
+		DEBUG("Out of memory.");
+		free(sources);
+		free(heap);
+		return -1;
+	}
+
+	for (i = 0; i < nr_files; i++) {
+		sources[i].index = i;
+		sources[i].rd = dat_reader_open(filenames[i]);
+		if (sources[i].rd == NULL) {
+			ret = -1;
+			continue;
+		}
+		switch (dat_reader_next(sources[i].rd, &sources[i].rec)) {
+		case 1:
+			heap[n++] = &sources[i];
+			break;
+		case -1:
+			if (ret == 0)
+				ret = DAT_TRUNCATED;
+			break;
+		}
+	}
+	for (i = n / 2; i-- > 0; )
+		heap_down(heap, n, i);
+
+	memset(&recent, 0, sizeof(recent));
+	dat_parser_init(&parser, fid, handler, arg);
+
+	while (n > 0) {
+		struct merge_source *src = heap[0];
+
+		if (is_duplicate(&recent, &src->rec))
+			nr_dups++;
+		else
+			dat_parser_feed(&parser, &src->rec);
+
+		/* Refill from the same source or drop it when exhausted */
+		switch (dat_reader_next(src->rd, &src->rec)) {
+		case 1:
+			break;
+		case -1:
+			if (ret == 0)
+				ret = DAT_TRUNCATED;
+			/* fall through */
+		default:
+			heap[0] = heap[--n];
+			break;
+		}
+		heap_down(heap, n, 0);
+	}
+	DEBUG("Merged %u files, %lu duplicate records dropped.", nr_files, nr_dups);
+
+	for (i = 0; i < nr_files; i++)
+		dat_reader_close(sources[i].rd);
+	free(sources);
+	free(heap);
+	return ret;
+}
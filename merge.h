@@ -0,0 +1,10 @@
+#ifndef MERGE_H_INCLUDED
+#define MERGE_H_INCLUDED
+
+#include "parse.h"
+
+extern int merge_dat_files(char *const *filenames, unsigned int nr_files,
+							struct fiducial_data *fid,
+							fiducial_handler_t handler, void *arg);
+
+#endif	/* MERGE_H_INCLUDED */
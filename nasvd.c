@@ -0,0 +1,593 @@
+#include <math.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "nasvd.h"
+#include "parse.h"
+#include "debug.h"
+#include "parallel.h"
+
+#define BLOCK_ROWS			256		/* spectra per storage block */
+#define TILE				64		/* channels per covariance tile */
+#define MAX_ITERATIONS		300
+#define CONVERGENCE			1e-7		/* Ritz residual relative to the largest eigenvalue */
+#define JACOBI_SWEEPS		50
+
+/*
+ * Spectra are kept once, in blocks of rows, and normalized and
+ * reconstructed in place. Blocks are the unit of work handed to
+ * the threads.
+ */
+struct nasvd_block {
+	float spec[BLOCK_ROWS][NR_CHANNELS];
+	double rec_time[BLOCK_ROWS];
+	double total[BLOCK_ROWS];
+};
+
+struct nasvd_task {
+	unsigned long first;		/* first block */
+	unsigned long last;			/* one past last block */
+	unsigned int first_row;		/* covariance rows reduced by the task */
+	unsigned int last_row;
+	double *cov;				/* private covariance accumulator */
+};
+
+static struct {
+	FILE *fp;
+	unsigned int nr_components;
+	unsigned int nr_threads;
+	unsigned long nr_rows;
+	int have_frame;					/* a frame has been taken */
+	double frame_time;				/* rsx.prev_timestamp of that frame */
+	unsigned long nr_blocks;
+	unsigned long max_blocks;
+	struct nasvd_block **blocks;
+	double sum[NR_CHANNELS];		/* sum of all spectra */
+	double inv_shape[NR_CHANNELS];	/* 1 / sqrt(mean spectral shape) */
+	double *basis;					/* leading components, one per row */
+	struct nasvd_task *tasks;
+	unsigned int nr_tasks;
+} nasvd;
+
+static inline unsigned int block_rows(unsigned long b)
+{
+	return b + 1 < nasvd.nr_blocks ? BLOCK_ROWS :
+				nasvd.nr_rows - b * BLOCK_ROWS;
+}
+
+static void *normalize_worker(void *arg)
+{
+	const struct nasvd_task *t = arg;
+	const double *restrict inv_shape = nasvd.inv_shape;
+	register unsigned long b;
+	register unsigned int r, j;
+
+	for (b = t->first; b < t->last; b++) {
+		struct nasvd_block *blk = nasvd.blocks[b];
+
+		for (r = 0; r < block_rows(b); r++) {
+			float *restrict x = blk->spec[r];
+			double inv_total = blk->total[r] > 0 ? 1.0 / sqrt(blk->total[r]) : 0.0;
+
+			for (j = 0; j < NR_CHANNELS; j++)
+				x[j] = x[j] * inv_total * inv_shape[j];
+		}
+	}
+	return NULL;
+}
+
+/* Upper triangle tiles of X^T X, accumulated per block in single precision. */
+static void *covariance_worker(void *arg)
+{
+	const struct nasvd_task *t = arg;
+	float acc[TILE][TILE];
+	register unsigned long b;
+	register unsigned int ti, tj, r, i, j;
+
+	for (b = t->first; b < t->last; b++) {
+		const struct nasvd_block *blk = nasvd.blocks[b];
+		unsigned int rows = block_rows(b);
+
+		for (ti = 0; ti < NR_CHANNELS; ti += TILE) {
+			for (tj = ti; tj < NR_CHANNELS; tj += TILE) {
+				memset(acc, 0, sizeof(acc));
+				for (r = 0; r < rows; r++) {
+					const float *restrict xi = &blk->spec[r][ti];
+					const float *restrict xj = &blk->spec[r][tj];
+
+					for (i = 0; i < TILE; i++) {
+						float *restrict a = acc[i];
+
+						for (j = 0; j < TILE; j++)
+							a[j] += xi[i] * xj[j];
+					}
+				}
+				for (i = 0; i < TILE; i++) {
+					double *restrict c = &t->cov[(ti + i) * NR_CHANNELS + tj];
+
+					for (j = 0; j < TILE; j++)
+						c[j] += acc[i][j];
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Sums the private accumulators into the first one, a band of rows per task. */
+static void *reduce_worker(void *arg)
+{
+	const struct nasvd_task *t = arg;
+	double *restrict dst = nasvd.tasks[0].cov;
+	register unsigned int i;
+	register unsigned long j;
+
+	for (i = 1; i < nasvd.nr_tasks; i++) {
+		const double *restrict src = nasvd.tasks[i].cov;
+
+		for (j = (unsigned long)t->first_row * NR_CHANNELS;
+				j < (unsigned long)t->last_row * NR_CHANNELS; j++)
+			dst[j] += src[j];
+	}
+	return NULL;
+}
+
+static void *reconstruct_worker(void *arg)
+{
+	const struct nasvd_task *t = arg;
+	const unsigned int k = nasvd.nr_components;
+	double proj[k];
+	register unsigned long b;
+	register unsigned int r, c, j;
+
+	for (b = t->first; b < t->last; b++) {
+		struct nasvd_block *blk = nasvd.blocks[b];
+
+		for (r = 0; r < block_rows(b); r++) {
+			float *restrict x = blk->spec[r];
+			double total = sqrt(blk->total[r]);
+
+			for (c = 0; c < k; c++) {
+				const double *restrict v = &nasvd.basis[c * NR_CHANNELS];
+				double dot = 0.0;
+
+				for (j = 0; j < NR_CHANNELS; j++)
+					dot += v[j] * x[j];
+				proj[c] = dot;
+			}
+
+			for (j = 0; j < NR_CHANNELS; j++)
+				x[j] = 0.0f;
+			for (c = 0; c < k; c++) {
+				const double *restrict v = &nasvd.basis[c * NR_CHANNELS];
+
+				for (j = 0; j < NR_CHANNELS; j++)
+					x[j] += proj[c] * v[j];
+			}
+
+			/* Undo the noise normalization */
+			for (j = 0; j < NR_CHANNELS; j++) {
+				double inv = nasvd.inv_shape[j];
+				x[j] = inv > 0 ? x[j] * total / inv : 0.0f;
+			}
+		}
+	}
+	return NULL;
+}
+
+/* Modified Gram-Schmidt, degenerate vectors are zeroed. */
+static void orthonormalize(double *q, unsigned int k)
+{
+	register unsigned int a, b, j;
+
+	for (a = 0; a < k; a++) {
+		double *qa = &q[a * NR_CHANNELS];
+		double norm = 0.0;
+
+		for (b = 0; b < a; b++) {
+			const double *qb = &q[b * NR_CHANNELS];
+			double dot = 0.0;
+
+			for (j = 0; j < NR_CHANNELS; j++)
+				dot += qa[j] * qb[j];
+			for (j = 0; j < NR_CHANNELS; j++)
+				qa[j] -= dot * qb[j];
+		}
+
+		for (j = 0; j < NR_CHANNELS; j++)
+			norm += qa[j] * qa[j];
+		norm = sqrt(norm);
+
+		for (j = 0; j < NR_CHANNELS; j++)
+			qa[j] = norm > 1e-12 ? qa[j] / norm : 0.0;
+	}
+}
+
+/*
+ * Eigenvalues and vectors of the symmetric m x m matrix h by cyclic
+ * Jacobi rotations, sorted by decreasing eigenvalue. h is destroyed,
+ * column a of w is the eigenvector of lambda[a].
+ */
+static void symmetric_eigen(double *h, double *w, double *lambda, unsigned int m)
+{
+	register unsigned int sweep, p, q, r;
+
+	for (p = 0; p < m; p++) {
+		for (q = 0; q < m; q++)
+			w[p * m + q] = p == q;
+	}
+
+	for (sweep = 0; sweep < JACOBI_SWEEPS; sweep++) {
+		double off = 0.0, diag = 0.0;
+
+		for (p = 0; p < m; p++) {
+			diag += h[p * m + p] * h[p * m + p];
+			for (q = p + 1; q < m; q++)
+				off += h[p * m + q] * h[p * m + q];
+		}
+		if (off <= 1e-30 * diag)
+			break;
+
+		for (p = 0; p < m; p++) {
+			for (q = p + 1; q < m; q++) {
+				double hpq = h[p * m + q], theta, t, c, sn;
+
+				if (hpq == 0.0)
+					continue;
+				theta = (h[q * m + q] - h[p * m + p]) / (2.0 * hpq);
+				t = (theta >= 0 ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1.0));
+				c = 1.0 / sqrt(t * t + 1.0);
+				sn = t * c;
+
+				for (r = 0; r < m; r++) {
+					double hrp = h[r * m + p], hrq = h[r * m + q];
+
+					h[r * m + p] = c * hrp - sn * hrq;
+					h[r * m + q] = sn * hrp + c * hrq;
+				}
+				for (r = 0; r < m; r++) {
+					double hpr = h[p * m + r], hqr = h[q * m + r];
+
+					h[p * m + r] = c * hpr - sn * hqr;
+					h[q * m + r] = sn * hpr + c * hqr;
+				}
+				for (r = 0; r < m; r++) {
+					double wrp = w[r * m + p], wrq = w[r * m + q];
+
+					w[r * m + p] = c * wrp - sn * wrq;
+					w[r * m + q] = sn * wrp + c * wrq;
+				}
+			}
+		}
+	}
+
+	for (p = 0; p < m; p++)
+		lambda[p] = h[p * m + p];
+
+	/* Selection sort of the pairs, m is small */
+	for (p = 0; p < m; p++) {
+		unsigned int best = p;
+		double tmp;
+
+		for (q = p + 1; q < m; q++) {
+			if (lambda[q] > lambda[best])
+				best = q;
+		}
+		if (best == p)
+			continue;
+
+		tmp = lambda[p];
+		lambda[p] = lambda[best];
+		lambda[best] = tmp;
+		for (r = 0; r < m; r++) {
+			tmp = w[r * m + p];
+			w[r * m + p] = w[r * m + best];
+			w[r * m + best] = tmp;
+		}
+	}
+}
+
+/* y = q w for m vectors of NR_CHANNELS, column a of w mixes vector a. */
+static void rotate_vectors(double *y, const double *q, const double *w, unsigned int m)
+{
+	register unsigned int a, b, j;
+
+	memset(y, 0, sizeof(double) * m * NR_CHANNELS);
+	for (a = 0; a < m; a++) {
+		double *restrict ya = &y[a * NR_CHANNELS];
+
+		for (b = 0; b < m; b++) {
+			const double *restrict qb = &q[b * NR_CHANNELS];
+			const double wba = w[b * m + a];
+
+			for (j = 0; j < NR_CHANNELS; j++)
+				ya[j] += wba * qb[j];
+		}
+	}
+}
+
+/*
+ * Leading eigenvectors of the covariance by subspace iteration with
+ * Rayleigh-Ritz projection. The subspace is oversampled to twice the
+ * number of components, so component a converges at the rate of
+ * lambda[2k] / lambda[a] instead of lambda[k] / lambda[a]. Stops once
+ * every one of the k leading Ritz pairs has a small residual.
+ */
+static int leading_components(const double *cov)
+{
+	const unsigned int k = nasvd.nr_components;
+	const unsigned int m = 2 * k < NR_CHANNELS ? 2 * k : NR_CHANNELS;
+	double *q = NULL, *z = NULL, *y = NULL, *cy = NULL;
+	double *h = NULL, *w = NULL, *lambda = NULL;
+	unsigned long seed = 12345;
+	register unsigned int it, a, b, i, j;
+	int ret = -1;
+
+	q = malloc(sizeof(double) * m * NR_CHANNELS);
+	z = malloc(sizeof(double) * m * NR_CHANNELS);
+	y = malloc(sizeof(double) * m * NR_CHANNELS);
+	cy = malloc(sizeof(double) * m * NR_CHANNELS);
+	h = malloc(sizeof(double) * m * m);
+	w = malloc(sizeof(double) * m * m);
+	lambda = malloc(sizeof(double) * m);
+	if (q == NULL || z == NULL || y == NULL || cy == NULL ||
+		h == NULL || w == NULL || lambda == NULL) {
+		DEBUG("Out of memory.");
+		goto out;
+	}
+
+	for (i = 0; i < m * NR_CHANNELS; i++) {
+		seed = seed * 1103515245 + 12345;
+		q[i] = (double)((seed >> 16) & 0x7fff) / 0x7fff - 0.5;
+	}
+	orthonormalize(q, m);
+
+	for (it = 0; it < MAX_ITERATIONS; it++) {
+		double residual = 0.0;
+
+		/* Each covariance row is read once for all components */
+		for (i = 0; i < NR_CHANNELS; i++) {
+			const double *restrict c = &cov[i * NR_CHANNELS];
+
+			for (a = 0; a < m; a++) {
+				const double *restrict qa = &q[a * NR_CHANNELS];
+				double dot = 0.0;
+
+				for (j = 0; j < NR_CHANNELS; j++)
+					dot += c[j] * qa[j];
+				z[a * NR_CHANNELS + i] = dot;
+			}
+		}
+
+		/* Rayleigh-Ritz: eigenpairs of the covariance projected on q */
+		for (a = 0; a < m; a++) {
+			for (b = a; b < m; b++) {
+				double dot = 0.0;
+
+				for (j = 0; j < NR_CHANNELS; j++)
+					dot += q[a * NR_CHANNELS + j] * z[b * NR_CHANNELS + j];
+				h[a * m + b] = dot;
+				h[b * m + a] = dot;
+			}
+		}
+		symmetric_eigen(h, w, lambda, m);
+		rotate_vectors(y, q, w, m);
+		rotate_vectors(cy, z, w, m);
+
+		for (a = 0; a < k; a++) {
+			double norm = 0.0;
+
+			for (j = 0; j < NR_CHANNELS; j++) {
+				double r = cy[a * NR_CHANNELS + j] - lambda[a] * y[a * NR_CHANNELS + j];
+				norm += r * r;
+			}
+			if (sqrt(norm) > residual)
+				residual = sqrt(norm);
+		}
+		if (residual <= CONVERGENCE * fabs(lambda[0]))
+			break;
+
+		/* Next subspace is the covariance applied to the Ritz vectors */
+		memcpy(q, cy, sizeof(double) * m * NR_CHANNELS);
+		orthonormalize(q, m);
+	}
+	DEBUG("NASVD subspace iteration finished after %u iterations.", it);
+	memcpy(nasvd.basis, y, sizeof(double) * k * NR_CHANNELS);
+	ret = 0;
+out:
+	free(q);
+	free(z);
+	free(y);
+	free(cy);
+	free(h);
+	free(w);
+	free(lambda);
+	return ret;
+}
+
+int nasvd_open_file(const char *filename, unsigned int nr_components,
+					unsigned int nr_threads)
+{
+	register unsigned int i;
+
+	if (filename == NULL || nr_components == 0 || nr_components > NR_CHANNELS)
+		return -1;
+
+	memset(&nasvd, 0, sizeof(nasvd));
+	nasvd.nr_components = nr_components;
+	nasvd.nr_threads = nr_threads ? nr_threads : 1;
+
+	nasvd.fp = fopen(filename, "w");
+	if (nasvd.fp == NULL) {
+		DEBUG("Failed to open file: %s", filename);
+		return -1;
+	}
+
+	fprintf(nasvd.fp, "%s", "REC_TIME,");
+	for (i = 1; i < NR_CHANNELS + 1; i++)
+		fprintf(nasvd.fp, "D%04d,", i);
+	fprintf(nasvd.fp, "%s", "\n");
+	return 0;
+}
+
+void nasvd_push(const struct fiducial_data *fid)
+{
+	const unsigned int *spec = fid->rsx.vd_dn.spectrum;
+	struct nasvd_block *blk;
+	unsigned int r = nasvd.nr_rows % BLOCK_ROWS;
+	double total = 0.0;
+	register unsigned int j;
+
+	if (nasvd.fp == NULL)
+		return;
+
+	/* Seconds repeating the last frame, or before the first, carry no new spectrum */
+	if (!fid->rsx.seen || (nasvd.have_frame && fid->rsx.prev_timestamp == nasvd.frame_time))
+		return;
+	nasvd.have_frame = 1;
+	nasvd.frame_time = fid->rsx.prev_timestamp;
+
+	if (r == 0) {
+		if (nasvd.nr_blocks == nasvd.max_blocks) {
+			unsigned long max = nasvd.max_blocks ? 2 * nasvd.max_blocks : 64;
+			struct nasvd_block **tmp = realloc(nasvd.blocks, max * sizeof(*tmp));
+
+			if (tmp == NULL) {
+				DEBUG("Out of memory, spectrum at %lf dropped.", fid->rec_time);
+				return;
+			}
+			nasvd.blocks = tmp;
+			nasvd.max_blocks = max;
+		}
+
+		blk = malloc(sizeof(*blk));
+		if (blk == NULL) {
+			DEBUG("Out of memory, spectrum at %lf dropped.", fid->rec_time);
+			return;
+		}
+		nasvd.blocks[nasvd.nr_blocks++] = blk;
+	}
+
+	blk = nasvd.blocks[nasvd.nr_blocks - 1];
+	for (j = 0; j < NR_CHANNELS; j++) {
+		blk->spec[r][j] = spec[j];
+		nasvd.sum[j] += spec[j];
+		total += spec[j];
+	}
+	blk->rec_time[r] = fid->rec_time;
+	blk->total[r] = total;
+	nasvd.nr_rows++;
+}
+
+static int nasvd_process(void)
+{
+	struct nasvd_task *tasks = NULL;
+	unsigned int nr_tasks;
+	double grand_total = 0.0;
+	unsigned long per_task;
+	register unsigned int i, j;
+	int ret = -1;
+
+	for (j = 0; j < NR_CHANNELS; j++)
+		grand_total += nasvd.sum[j];
+	if (grand_total <= 0) {
+		DEBUG("No counts in spectra, NASVD skipped.");
+		return -1;
+	}
+	for (j = 0; j < NR_CHANNELS; j++) {
+		double shape = nasvd.sum[j] / grand_total;
+		nasvd.inv_shape[j] = shape > 0 ? 1.0 / sqrt(shape) : 0.0;
+	}
+
+	/* Every task holds a full covariance, no more tasks than blocks */
+	nr_tasks = nasvd.nr_threads < nasvd.nr_blocks ? nasvd.nr_threads : nasvd.nr_blocks;
+	tasks = calloc(nr_tasks, sizeof(*tasks));
+	if (tasks == NULL) {
+		DEBUG("Out of memory.");
+		return -1;
+	}
+	nasvd.tasks = tasks;
+	nasvd.nr_tasks = nr_tasks;
+
+	per_task = (nasvd.nr_blocks + nr_tasks - 1) / nr_tasks;
+	for (i = 0; i < nr_tasks; i++) {
+		tasks[i].first = i * per_task < nasvd.nr_blocks ? i * per_task : nasvd.nr_blocks;
+		tasks[i].last = tasks[i].first + per_task < nasvd.nr_blocks ?
+						tasks[i].first + per_task : nasvd.nr_blocks;
+		tasks[i].first_row = (unsigned long)i * NR_CHANNELS / nr_tasks;
+		tasks[i].last_row = (unsigned long)(i + 1) * NR_CHANNELS / nr_tasks;
+		tasks[i].cov = calloc((size_t)NR_CHANNELS * NR_CHANNELS, sizeof(double));
+		if (tasks[i].cov == NULL) {
+			DEBUG("Out of memory.");
+			goto out;
+		}
+	}
+
+	nasvd.basis = malloc(sizeof(double) * nasvd.nr_components * NR_CHANNELS);
+	if (nasvd.basis == NULL) {
+		DEBUG("Out of memory.");
+		goto out;
+	}
+
+	if (parallel_run(normalize_worker, tasks, sizeof(*tasks), nr_tasks) != 0 ||
+		parallel_run(covariance_worker, tasks, sizeof(*tasks), nr_tasks) != 0 ||
+		parallel_run(reduce_worker, tasks, sizeof(*tasks), nr_tasks) != 0) {
+		DEBUG("NASVD worker failed.");
+		goto out;
+	}
+
+	/* Mirror the upper triangle tiles */
+	for (i = 0; i < NR_CHANNELS; i++) {
+		for (j = 0; j < i; j++) {
+			if (j / TILE != i / TILE)
+				tasks[0].cov[i * NR_CHANNELS + j] = tasks[0].cov[j * NR_CHANNELS + i];
+		}
+	}
+
+	if (leading_components(tasks[0].cov) != 0 ||
+		parallel_run(reconstruct_worker, tasks, sizeof(*tasks), nr_tasks) != 0) {
+		DEBUG("NASVD reconstruction failed.");
+		goto out;
+	}
+	ret = 0;
+out:
+	for (i = 0; i < nr_tasks; i++)
+		free(tasks[i].cov);
+	free(tasks);
+	nasvd.tasks = NULL;
+	nasvd.nr_tasks = 0;
+	return ret;
+}
+
+int nasvd_close_file(void)
+{
+	register unsigned long b;
+	register unsigned int r, j;
+	int ret = 0;
+
+	if (nasvd.fp == NULL)
+		return -1;
+
+	if (nasvd.nr_rows > 0)
+		ret = nasvd_process();
+
+	for (b = 0; b < nasvd.nr_blocks; b++) {
+		const struct nasvd_block *blk = nasvd.blocks[b];
+
+		for (r = 0; ret == 0 && r < block_rows(b); r++) {
+			fprintf(nasvd.fp, "%lf,", blk->rec_time[r]);
+			for (j = 0; j < NR_CHANNELS; j++)
+				fprintf(nasvd.fp, "%.3f,", blk->spec[r][j]);
+			fprintf(nasvd.fp, "%s", "\n");
+		}
+		free(nasvd.blocks[b]);
+	}
+
+	free(nasvd.blocks);
+	free(nasvd.basis);
+	fclose(nasvd.fp);
+	memset(&nasvd, 0, sizeof(nasvd));
+	return ret;
+}
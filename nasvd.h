@@ -0,0 +1,14 @@
+#ifndef NASVD_H_INCLUDED
+#define NASVD_H_INCLUDED
+
+struct fiducial_data;
+
+/* Number of principal components kept by default. */
+#define NASVD_COMPONENTS		8
+
+extern int nasvd_open_file(const char *filename, unsigned int nr_components,
+							unsigned int nr_threads);
+extern void nasvd_push(const struct fiducial_data *fid);
+extern int nasvd_close_file(void);
+
+#endif	/* NASVD_H_INCLUDED */
@@ -0,0 +1,55 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "parallel.h"
+#include "debug.h"
+
+/*
+ * Runs fn once per thread, thread i gets the i-th element of the args
+ * array whose elements are size bytes. The calling thread takes the
+ * first element. If a thread can not be created its work is done by
+ * the caller instead, as is all of it when out of memory.
+ */
+int parallel_run(void *(*fn)(void *), void *args, size_t size,
+					unsigned int nr_threads)
+{
+	pthread_t *tid = NULL;
+	int *started = NULL;
+	register unsigned int i;
+	int ret = 0;
+
+	if (nr_threads > 1) {
+		tid = malloc(nr_threads * sizeof(*tid));
+		started = calloc(nr_threads, sizeof(*started));
+	}
+	if (tid == NULL || started == NULL) {
+		if (nr_threads > 1)
+			DEBUG("Out of memory, running in caller.");
+		fn(args);
+		for (i = 1; i < nr_threads; i++)
+			fn((char *)args + i * size);
+		free(tid);
+		free(started);
+		return 0;
+	}
+
+	for (i = 1; i < nr_threads; i++) {
+		started[i] = pthread_create(&tid[i], NULL, fn, (char *)args + i * size) == 0;
+		if (!started[i]) {
+			DEBUG("Failed to create thread, running in caller.");
+			fn((char *)args + i * size);
+		}
+	}
+	fn(args);
+
+	for (i = 1; i < nr_threads; i++) {
+		if (started[i] && pthread_join(tid[i], NULL) != 0)
+			ret = -1;
+	}
+	free(tid);
+	free(started);
+	return ret;
+}
@@ -0,0 +1,9 @@
+#ifndef PARALLEL_H_INCLUDED
+#define PARALLEL_H_INCLUDED
+
+#include <stddef.h>
+
+extern int parallel_run(void *(*fn)(void *), void *args, size_t size,
+						unsigned int nr_threads);
+
+#endif	/* PARALLEL_H_INCLUDED */
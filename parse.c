@@ -4,7 +4,6 @@
 #include <string.h>
 #include <stdlib.h>
 
-#include "csv.h"
 #include "parse.h"
 #include "debug.h"
 
@@ -104,14 +103,15 @@ static int extract_gps_gpzda_fields(char *str, struct gpzda_fields *zda)
 {
 	unsigned int hour, min, sec, day, mon, year, tok_nr = 0;
 	const char *token = NULL;
+	char *saveptr = NULL;
 
 	if (data_crc_check(str) != 0) {
 		DEBUG("data_crc_check() failed.");
 		return -1;
 	}
 		
-	token = strtok(str, ",");
-	while ((token = strtok(NULL, ",")) != NULL) {
+	token = strtok_r(str, ",", &saveptr);
+	while ((token = strtok_r(NULL, ",", &saveptr)) != NULL) {
 		switch (++tok_nr) {
 		case 1:
 			if (sscanf(token, "%2d%2d%2d%*s", &hour, &min, &sec) == 3) {
@@ -154,6 +154,7 @@ static int extract_gps_gpzda_fields(char *str, struct gpzda_fields *zda)
 static int extract_gps_gpgga_fields(char *str, struct gpgga_fields *gga)
 {
 	const char *token = NULL;
+	char *saveptr = NULL;
 	unsigned int tok_nr = 0;
 
 	if (data_crc_check(str) != 0) {
@@ -161,8 +162,8 @@ static int extract_gps_gpgga_fields(char *str, struct gpgga_fields *gga)
 		return -1;
 	}
 		
-	token = strtok(str, ",");
-	while ((token = strtok(NULL, ",")) != NULL) {
+	token = strtok_r(str, ",", &saveptr);
+	while ((token = strtok_r(NULL, ",", &saveptr)) != NULL) {
 		double dv = 0;
 		float fv = 0;
 		int hr = 0, min = 0, iv = 0;
@@ -447,147 +448,215 @@ static int extract_rsx_fields(const unsigned char *buf, struct rsx_fields *rsx)
 	return 0;	
 }
 
-#define NODATA_DURATION		3000
+struct dat_reader {
+	FILE *fp;
+};
 
-static void warn_on_no_data(double curr_timestamp, double last_timestamp, 
-							const char *hdr)
+struct dat_reader *dat_reader_open(const char *filename)
 {
-	double duration = curr_timestamp - last_timestamp;
-	
-	if (duration >= NODATA_DURATION) {
-		printf("[WARNING at %lf sec]: %s data not found for %.0lf seconds.\n", 
-			curr_timestamp, hdr, duration);
-	}
-}
+	struct dat_reader *rd = NULL;
 
-int parse_dat_file(const char *filename, struct fiducial_data *fid)
-{
-	FILE *fp = NULL;
-	char buf[256] = "";
-	double timestamp, prev_timestamp;
-	unsigned int init = 1;
-	
 	if (filename == NULL)
-		return -1;
-		
-	fp = fopen(filename, "rb");
-	if (fp == NULL) {
+		return NULL;
+
+	rd = malloc(sizeof(*rd));
+	if (rd == NULL) {
+		DEBUG("Out of memory.");
+		return NULL;
+	}
+
+	rd->fp = fopen(filename, "rb");
+	if (rd->fp == NULL) {
 		DEBUG("Failed to open file: %s", filename);
-		return -1;
+		free(rd);
+		return NULL;
 	}
+	return rd;
+}
+
+void dat_reader_close(struct dat_reader *rd)
+{
+	if (rd == NULL)
+		return;
+	fclose(rd->fp);
+	free(rd);
+}
+
+/*
+ * Reads the next known record, returns 1 on success, 0 at end of file
+ * and -1 when the file ends inside an RSX frame.
+ */
+int dat_reader_next(struct dat_reader *rd, struct dat_record *rec)
+{
+	char buf[DAT_LINE_SIZE] = "";
 
-	while (fgets(buf, 256, fp)) {
+	while (fgets(rec->line, DAT_LINE_SIZE, rd->fp)) {
 		hdr_t hdr;
-		char *remains = NULL;
-		
+		char *remains = NULL, *token = NULL;
+
 		/* Checking header */
+		memcpy(buf, rec->line, DAT_LINE_SIZE);
 		hdr = match_header((strtok_r(buf, ",", &remains)));
 		if (hdr == HDR_UNKNOWN || !remains)
 			continue;
-		
+
 		/* Recording time */
-		timestamp = atof(strtok_r(remains, ",", &remains));	
-		if (remains == NULL)
+		token = strtok_r(remains, ",", &remains);
+		if (token == NULL || remains == NULL)
 			continue;
-		
-		fid->rec_time = floor(timestamp / 1000);
-		if (init) {
-			prev_timestamp = fid->rec_time;
+		rec->timestamp = atof(token);
+
+		/* RSX line is followed by the binary frame */
+		rec->has_frame = (hdr == HDR_RSX);
+		if (rec->has_frame) {
+			if (fread(rec->frame, RSX_FRAME_SIZE, 1, rd->fp) != 1) {
+				DEBUG("Truncated RSX frame at %.0lf ms.", rec->timestamp);
+				return -1;
+			}
+			rec->rsx_time = four_bytes_to_long(rec->frame[15], rec->frame[14],
+												rec->frame[13], rec->frame[12]);
+		}
+		return 1;
+	}
+	return 0;
+}
+
+void dat_parser_init(struct dat_parser *p, struct fiducial_data *fid,
+						fiducial_handler_t handler, void *arg)
+{
+	p->fid = fid;
+	p->handler = handler;
+	p->arg = arg;
+	p->prev_timestamp = 0;
+	p->init = 1;
+}
+
+void dat_parser_feed(struct dat_parser *p, const struct dat_record *rec)
+{
+	struct fiducial_data *fid = p->fid;
+	char buf[DAT_LINE_SIZE] = "";
+	char *remains = NULL;
+	hdr_t hdr;
+
+	fid->rec_time = floor(rec->timestamp / 1000);
+	if (p->init) {
+		p->prev_timestamp = fid->rec_time;
+		fid->rsx.prev_timestamp = fid->rec_time;
+		fid->gga.prev_timestamp = fid->rec_time;
+		fid->zda.prev_timestamp = fid->rec_time;
+		fid->ral.prev_timestamp = fid->rec_time;
+		fid->trm.prev_timestamp = fid->rec_time;
+		fid->hum.prev_timestamp = fid->rec_time;
+		fid->bar.prev_timestamp = fid->rec_time;
+		fid->line.prev_timestamp = fid->rec_time;
+		p->init = 0;
+	}
+
+	/* First record of a new second completes the previous one */
+	if (p->prev_timestamp < fid->rec_time) {
+		p->prev_timestamp = fid->rec_time;
+		p->handler(fid, p->arg);
+	}
+
+	memcpy(buf, rec->line, DAT_LINE_SIZE);
+	hdr = match_header(strtok_r(buf, ",", &remains));
+	strtok_r(remains, ",", &remains);
+
+	switch (hdr) {
+	case HDR_RSX:
+		if (!extract_rsx_fields(rec->frame, &fid->rsx)) {
 			fid->rsx.prev_timestamp = fid->rec_time;
-			fid->gga.prev_timestamp = fid->rec_time;
-			fid->zda.prev_timestamp = fid->rec_time;
-			fid->ral.prev_timestamp = fid->rec_time;
+			fid->rsx.seen = 1;
+		}
+		break;
+
+	case HDR_GPS:
+		switch (gps_match_header(remains)) {
+		case HDR_GPS_GPGGA:
+			if (!extract_gps_gpgga_fields(remains, &fid->gga)) {
+				fid->gga.prev_timestamp = fid->rec_time;
+				fid->gga.seen = 1;
+			}
+			break;
+
+		case HDR_GPS_GPZDA:
+			if (!extract_gps_gpzda_fields(remains, &fid->zda)) {
+				fid->zda.prev_timestamp = fid->rec_time;
+				fid->zda.seen = 1;
+			}
+			break;
+		default:
+			break;
+		}
+
+		break;
+
+	case HDR_TRM:
+		if (!extract_trm_fields(remains, &fid->trm)) {
 			fid->trm.prev_timestamp = fid->rec_time;
+			fid->trm.seen = 1;
+		}
+		break;
+
+	case HDR_HUM:
+		if (!extract_hum_fields(remains, &fid->hum)) {
 			fid->hum.prev_timestamp = fid->rec_time;
-			fid->bar.prev_timestamp = fid->rec_time;	
-			fid->line.prev_timestamp = fid->rec_time;																				
-			init = 0;
+			fid->hum.seen = 1;
 		}
-		
-		if (prev_timestamp >= fid->rec_time) {	
-			char rsx_buf[4248] = "";
-						
-			switch (hdr) {
-			case HDR_RSX:
-				if (fread(rsx_buf, 4248, 1, fp) == 1) {
-					if (!extract_rsx_fields(rsx_buf, &fid->rsx)) {
-						fid->rsx.prev_timestamp = fid->rec_time;
-					}
-				}
-				break;
-			
-			case HDR_GPS:
-				switch (gps_match_header(remains)) {
-				case HDR_GPS_GPGGA:
-					if (!extract_gps_gpgga_fields(remains, &fid->gga)) {
-						fid->gga.prev_timestamp = fid->rec_time;
-					}					
-					break;
-				
-				case HDR_GPS_GPZDA:
-					if (!extract_gps_gpzda_fields(remains, &fid->zda)) {
-						fid->zda.prev_timestamp = fid->rec_time;
-					}		
-					break;
-				default:
-					break;
-				}
-		
-				break;	
-				
-			case HDR_TRM:
-				if (!extract_trm_fields(remains, &fid->trm)) {
-					fid->trm.prev_timestamp = fid->rec_time;
-				}
-				break;	
-				
-			case HDR_HUM:
-				if (!extract_hum_fields(remains, &fid->hum)) {
-					fid->hum.prev_timestamp = fid->rec_time;
-				}	
-				break;	
-		
-			case HDR_BAR:
-				if (!extract_bar_fields(remains, &fid->bar)) {
-					fid->bar.prev_timestamp = fid->rec_time;
-				}
-				break;
-			
-			case HDR_NAV:
-				switch (nav_match_header(remains)) {
-				case HDR_NAV_RDALT:
-					if (!extract_nav_rdalt_fields(remains, &fid->ral)) {
-						fid->ral.prev_timestamp = fid->rec_time;
-					}					
-					break;
-				
-				case HDR_NAV_LINE:
-					if (!extract_nav_line_fields(remains, &fid->line)) {
-						fid->line.prev_timestamp = fid->rec_time;
-					}		
-					break;
-				}			
-		
-				break;	
-			
-			case HDR_UNKNOWN:
-		
-				break;				
+		break;
+
+	case HDR_BAR:
+		if (!extract_bar_fields(remains, &fid->bar)) {
+			fid->bar.prev_timestamp = fid->rec_time;
+			fid->bar.seen = 1;
+		}
+		break;
+
+	case HDR_NAV:
+		switch (nav_match_header(remains)) {
+		case HDR_NAV_RDALT:
+			if (!extract_nav_rdalt_fields(remains, &fid->ral)) {
+				fid->ral.prev_timestamp = fid->rec_time;
+				fid->ral.seen = 1;
+			}
+			break;
+
+		case HDR_NAV_LINE:
+			if (!extract_nav_line_fields(remains, &fid->line)) {
+				fid->line.prev_timestamp = fid->rec_time;
+				fid->line.seen = 1;
 			}
-					
-		} else {
-			prev_timestamp = fid->rec_time;			
-			warn_on_no_data(fid->rec_time, fid->trm.prev_timestamp, "Temperature");
-			warn_on_no_data(fid->rec_time, fid->hum.prev_timestamp, "Humidity");
-			warn_on_no_data(fid->rec_time, fid->bar.prev_timestamp, "Pressure");
-			warn_on_no_data(fid->rec_time, fid->rsx.prev_timestamp, "RSX");
-			warn_on_no_data(fid->rec_time, fid->gga.prev_timestamp, "GPS GPGGA");
-			warn_on_no_data(fid->rec_time, fid->zda.prev_timestamp, "GPS GPZDA");	
-			warn_on_no_data(fid->rec_time, fid->ral.prev_timestamp, "NAV RDALT");
-			warn_on_no_data(fid->rec_time, fid->line.prev_timestamp, "NAV LINE");					
-			csv_format_file(fid);
-		}		
+			break;
+		default:
+			break;
+		}
+
+		break;
+
+	default:
+		break;
 	}
-	fclose(fp);
-	return 0;
+}
+
+int parse_dat_file(const char *filename, struct fiducial_data *fid,
+					fiducial_handler_t handler, void *arg)
+{
+	struct dat_reader *rd = NULL;
+	struct dat_record rec;
+	struct dat_parser parser;
+	int ret;
+
+	if (filename == NULL || handler == NULL)
+		return -1;
+
+	rd = dat_reader_open(filename);
+	if (rd == NULL)
+		return -1;
+
+	dat_parser_init(&parser, fid, handler, arg);
+	while ((ret = dat_reader_next(rd, &rec)) == 1)
+		dat_parser_feed(&parser, &rec);
+
+	dat_reader_close(rd);
+	return ret < 0 ? DAT_TRUNCATED : 0;
 }
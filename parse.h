@@ -9,26 +9,31 @@
 struct trm_fields {
 	double temperature;
 	double prev_timestamp;
+	int seen;
 };
 
 struct bar_fields {
 	double pressure;
 	double prev_timestamp;
+	int seen;
 };
 
 struct hum_fields {
 	double humidity;
 	double prev_timestamp;
+	int seen;
 };
 
 struct rdalt_fields {
 	double agl_height;
 	double prev_timestamp;
+	int seen;
 };
 
 struct line_fields {
 	unsigned int line_nr;
 	double prev_timestamp;
+	int seen;
 };
 
 /* gps fix quality identifier. */
@@ -41,6 +46,7 @@ typedef enum gps_fix_t {
 /* Structure to keep GPGGA string extracted fields. */
 struct gpgga_fields {
 	double prev_timestamp;
+	int seen;
 	double latitude;			/* Latitude value in degrees */
 	char latitude_hemisphere;	/* Latitude hemisphere indicator */
 	double longitude;			/* Longitude value in degrees */
@@ -61,6 +67,7 @@ struct gpgga_fields {
 
 struct gpzda_fields {
 	double prev_timestamp;
+	int seen;
 	struct tm utc;
 };
 
@@ -73,12 +80,17 @@ struct virtual_detector {
 
 struct rsx_fields {
 	double prev_timestamp;
+	int seen;
 	unsigned long rsx_time;
 	struct virtual_detector vd_up, vd_dn;
 	unsigned char crystal_labels[NR_CRYSTALS];
     unsigned int crystal_error_flags[NR_CRYSTALS];
 };
 
+/*
+ * State of every sensor at the end of a second. Sensors keep their last
+ * values, seen is set once the first record of a sensor was decoded.
+ */
 struct fiducial_data {
 	double rec_time;
 	struct rsx_fields rsx;
@@ -91,6 +103,47 @@ struct fiducial_data {
 	struct gpzda_fields zda;
 };
 
-extern int parse_dat_file(const char *filename, struct fiducial_data *fid);
+/* Called once for every completed second of data. */
+typedef void (*fiducial_handler_t)(struct fiducial_data *fid, void *arg);
+
+#define DAT_LINE_SIZE		256
+#define RSX_FRAME_SIZE		4248
+
+/* One raw record of a .dat file. */
+struct dat_record {
+	double timestamp;					/* Recording time in ms */
+	int has_frame;						/* RSX record with binary frame */
+	unsigned long rsx_time;				/* RSX frame time, if has_frame */
+	char line[DAT_LINE_SIZE];
+	unsigned char frame[RSX_FRAME_SIZE];
+};
+
+/* Builds fiducials out of a time ordered stream of records. */
+struct dat_parser {
+	struct fiducial_data *fid;
+	fiducial_handler_t handler;
+	void *arg;
+	double prev_timestamp;
+	int init;
+};
+
+struct dat_reader;
+
+extern struct dat_reader *dat_reader_open(const char *filename);
+extern int dat_reader_next(struct dat_reader *rd, struct dat_record *rec);
+extern void dat_reader_close(struct dat_reader *rd);
+
+extern void dat_parser_init(struct dat_parser *p, struct fiducial_data *fid,
+							fiducial_handler_t handler, void *arg);
+extern void dat_parser_feed(struct dat_parser *p, const struct dat_record *rec);
+
+/*
+ * Returns 0, -1 when the file can not be opened, or DAT_TRUNCATED when
+ * it ends inside an RSX frame; the records before it were still parsed.
+ */
+#define DAT_TRUNCATED	1
+
+extern int parse_dat_file(const char *filename, struct fiducial_data *fid,
+							fiducial_handler_t handler, void *arg);
 
 #endif	/* PARSE_H_INCLUDED */
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#include "pool.h"
+#include "debug.h"
+#include "parallel.h"
+
+/*
+ * Work-stealing pool. Items are dealt round robin into one queue per
+ * worker, keeping the caller's order, so a list sorted largest first
+ * gives every worker its share of the big items up front. A worker
+ * takes items from the front of its own queue; once that is empty it
+ * steals from the back of the fullest other queue, where the smallest
+ * items are.
+ */
+struct pool_queue {
+	pthread_mutex_t lock;
+	void **items;
+	unsigned long head;
+	unsigned long tail;
+};
+
+struct pool_worker {
+	unsigned int index;
+	struct pool *pool;
+};
+
+struct pool {
+	struct pool_queue *queues;
+	unsigned int nr_threads;
+	pool_fn_t fn;
+	void *arg;
+};
+
+static void *pop_own(struct pool_queue *q)
+{
+	void *item = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->head < q->tail)
+		item = q->items[q->head++];
+	pthread_mutex_unlock(&q->lock);
+	return item;
+}
+
+static void *steal(struct pool *pool, unsigned int self)
+{
+	for (;;) {
+		struct pool_queue *victim = NULL;
+		unsigned long most = 0;
+		void *item = NULL;
+		register unsigned int i;
+
+		/* The choice is re-checked once the victim's lock is taken again */
+		for (i = 1; i < pool->nr_threads; i++) {
+			struct pool_queue *q = &pool->queues[(self + i) % pool->nr_threads];
+			unsigned long left;
+
+			pthread_mutex_lock(&q->lock);
+			left = q->tail - q->head;
+			pthread_mutex_unlock(&q->lock);
+
+			if (left > most) {
+				most = left;
+				victim = q;
+			}
+		}
+		if (victim == NULL)
+			return NULL;
+
+		pthread_mutex_lock(&victim->lock);
+		if (victim->head < victim->tail)
+			item = victim->items[--victim->tail];
+		pthread_mutex_unlock(&victim->lock);
+
+		if (item)
+			return item;
+	}
+}
+
+static void *pool_worker(void *arg)
+{
+	struct pool_worker *w = arg;
+	struct pool *pool = w->pool;
+	void *item;
+
+	while ((item = pop_own(&pool->queues[w->index])) != NULL ||
+			(item = steal(pool, w->index)) != NULL)
+		pool->fn(item, w->index, pool->arg);
+	return NULL;
+}
+
+int pool_run(void **items, unsigned long nr_items, unsigned int nr_threads,
+				pool_fn_t fn, void *arg)
+{
+	struct pool pool;
+	struct pool_worker *workers = NULL;
+	register unsigned long i;
+	int ret = -1;
+
+	if (items == NULL || fn == NULL)
+		return -1;
+	if (nr_threads == 0)
+		nr_threads = 1;
+	if (nr_threads > nr_items)
+		nr_threads = nr_items ? nr_items : 1;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.nr_threads = nr_threads;
+	pool.fn = fn;
+	pool.arg = arg;
+
+	pool.queues = calloc(nr_threads, sizeof(*pool.queues));
+	workers = calloc(nr_threads, sizeof(*workers));
+	if (pool.queues == NULL || workers == NULL) {
+		DEBUG("Out of memory.");
+		goto out;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		struct pool_queue *q = &pool.queues[i];
+
+		q->items = malloc(((nr_items + nr_threads - 1) / nr_threads + 1) * sizeof(void *));
+		if (q->items == NULL) {
+			DEBUG("Out of memory.");
+			goto out;
+		}
+		pthread_mutex_init(&q->lock, NULL);
+		workers[i].index = i;
+		workers[i].pool = &pool;
+	}
+
+	for (i = 0; i < nr_items; i++) {
+		struct pool_queue *q = &pool.queues[i % nr_threads];
+		q->items[q->tail++] = items[i];
+	}
+
+	ret = parallel_run(pool_worker, workers, sizeof(*workers), nr_threads);
+
+out:
+	for (i = 0; pool.queues && i < nr_threads; i++) {
+		if (pool.queues[i].items)
+			pthread_mutex_destroy(&pool.queues[i].lock);
+		free(pool.queues[i].items);
+	}
+	free(pool.queues);
+	free(workers);
+	return ret;
+}
@@ -0,0 +1,10 @@
+#ifndef POOL_H_INCLUDED
+#define POOL_H_INCLUDED
+
+/* Processes one item, worker is the index of the calling thread. */
+typedef void (*pool_fn_t)(void *item, unsigned int worker, void *arg);
+
+extern int pool_run(void **items, unsigned long nr_items, unsigned int nr_threads,
+					pool_fn_t fn, void *arg);
+
+#endif	/* POOL_H_INCLUDED */
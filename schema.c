@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "debug.h"
+#include "schema.h"
+
+#define SCHEMA_NAME_SIZE	16
+#define SCHEMA_FLUSH_SIZE	(64 * 1024)
+
+#define DESC_COL(name, kind, value)								\
+	{ #name, KIND_##kind, 1, sizeof(kind_##kind##_t),			\
+		offsetof(struct fiducial_row, name) },
+#define DESC_ARR(name, kind, count, digits, array)				\
+	{ #name, KIND_##kind, count, sizeof(kind_##kind##_t),		\
+		offsetof(struct fiducial_row, name) },
+
+const struct schema_column schema_columns[] = {
+	FIDUCIAL_COLUMNS(DESC_COL, DESC_ARR)
+};
+
+const unsigned int nr_schema_columns = sizeof(schema_columns) / sizeof(schema_columns[0]);
+
+/* Packed size of one binary record. */
+#define SIZE_COL(name, kind, value)					+ sizeof(kind_##kind##_t)
+#define SIZE_ARR(name, kind, count, digits, array)	+ (count) * sizeof(kind_##kind##_t)
+#define SCHEMA_RECORD_SIZE	(0 FIDUCIAL_COLUMNS(SIZE_COL, SIZE_ARR))
+
+void schema_gather_row(struct fiducial_row *row, const struct fiducial_data *fid)
+{
+	register unsigned int i;
+
+#define GATHER_COL(name, kind, value)	row->name = (value);
+#define GATHER_ARR(name, kind, count, digits, array)	\
+	for (i = 0; i < (count); i++)						\
+		row->name[i] = (array)[i];
+	FIDUCIAL_COLUMNS(GATHER_COL, GATHER_ARR)
+#undef GATHER_COL
+#undef GATHER_ARR
+}
+
+static FILE *fp_bin = NULL;
+static unsigned char *buf_bin = NULL;
+static size_t len_bin = 0;
+
+static void flush_binary(void)
+{
+	if (len_bin > 0 && fwrite(buf_bin, len_bin, 1, fp_bin) != 1)
+		DEBUG("Failed to write binary fiducial file.");
+	len_bin = 0;
+}
+
+int schema_open_file(const char *filename)
+{
+	uint32_t version = 1, nr_columns = nr_schema_columns;
+	register unsigned int i;
+
+	if (filename == NULL)
+		return -1;
+
+	buf_bin = malloc(SCHEMA_FLUSH_SIZE + SCHEMA_RECORD_SIZE);
+	if (buf_bin == NULL) {
+		DEBUG("Out of memory.");
+		return -1;
+	}
+
+	fp_bin = fopen(filename, "wb");
+	if (fp_bin == NULL) {
+		DEBUG("Failed to open file: %s", filename);
+		free(buf_bin);
+		buf_bin = NULL;
+		return -1;
+	}
+
+	fwrite("AGDF", 4, 1, fp_bin);
+	fwrite(&version, sizeof(version), 1, fp_bin);
+	fwrite(&nr_columns, sizeof(nr_columns), 1, fp_bin);
+	for (i = 0; i < nr_schema_columns; i++) {
+		const struct schema_column *col = &schema_columns[i];
+		char name[SCHEMA_NAME_SIZE] = "";
+		uint32_t kind = col->kind, count = col->count, size = col->size;
+
+		strncpy(name, col->name, sizeof(name) - 1);
+		fwrite(name, sizeof(name), 1, fp_bin);
+		fwrite(&kind, sizeof(kind), 1, fp_bin);
+		fwrite(&count, sizeof(count), 1, fp_bin);
+		fwrite(&size, sizeof(size), 1, fp_bin);
+	}
+	return 0;
+}
+
+void schema_push(const struct fiducial_data *fid)
+{
+	struct fiducial_row row;
+	register unsigned int i;
+
+	if (fp_bin == NULL)
+		return;
+
+	schema_gather_row(&row, fid);
+	for (i = 0; i < nr_schema_columns; i++) {
+		size_t len = schema_columns[i].count * schema_columns[i].size;
+
+		memcpy(buf_bin + len_bin, (const char *)&row + schema_columns[i].offset, len);
+		len_bin += len;
+	}
+	if (len_bin >= SCHEMA_FLUSH_SIZE)
+		flush_binary();
+}
+
+void schema_close_file(void)
+{
+	if (fp_bin == NULL)
+		return;
+
+	flush_binary();
+	fclose(fp_bin);
+	fp_bin = NULL;
+	free(buf_bin);
+	buf_bin = NULL;
+}
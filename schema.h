@@ -0,0 +1,125 @@
+#ifndef SCHEMA_H_INCLUDED
+#define SCHEMA_H_INCLUDED
+
+#include <stddef.h>
+
+#include "parse.h"
+
+/*
+ * Column kinds: K(kind, C type). The kind picks the csv emitter
+ * (emit_<kind> in csv.c) and the element type of the binary column.
+ */
+#define SCHEMA_KINDS(K)						\
+	K(F6,		double)		/* %lf */				\
+	K(DEG,		double)		/* %7.4lf */			\
+	K(F2,		double)		/* %.2lf */				\
+	K(F1,		double)		/* %.1lf */				\
+	K(INT,		int)		/* %d */				\
+	K(LONG,		long)		/* %ld */				\
+	K(CHAR,		unsigned char)	/* %c */			\
+	K(DATE,		struct schema_date)	/* YYYY/MM/DD */	\
+	K(TIME,		struct schema_time)	/* HH:MM:SS.ss */	\
+	K(EMPTY,	char)		/* always empty */
+
+struct schema_date {
+	int year;
+	int mon;
+	int mday;
+};
+
+struct schema_time {
+	int hours;
+	int minutes;
+	float seconds;
+};
+
+#define SCHEMA_DATE(y, m, d)	((struct schema_date){ (y), (m), (d) })
+#define SCHEMA_TIME(h, m, s)	((struct schema_time){ (h), (m), (s) })
+
+/*
+ * Output columns, in order. Each line is one column of the csv and
+ * binary outputs and of struct fiducial_row:
+ *   COL(name, kind, value)                  value read from fid
+ *   ARR(name, kind, count, digits, array)   count columns name01.., from fid
+ */
+#define FIDUCIAL_COLUMNS(COL, ARR)											\
+	COL(REC_TIME,		F6,		fid->rec_time)									\
+	COL(GPS_DATE,		DATE,	SCHEMA_DATE(fid->zda.utc.tm_year,				\
+									fid->zda.utc.tm_mon, fid->zda.utc.tm_mday))	\
+	COL(GPS_TIME,		TIME,	SCHEMA_TIME(fid->gga.hours, fid->gga.minutes,	\
+									fid->gga.seconds))							\
+	COL(GPS_LAT,		DEG,	fid->gga.latitude)								\
+	COL(GPS_LON,		DEG,	fid->gga.longitude)								\
+	COL(GPS_ALT,		F2,		fid->gga.altitude)								\
+	COL(GPS_FIX,		INT,	fid->gga.fix)									\
+	COL(GPS_SATS,		INT,	fid->gga.nsat)									\
+	COL(GPS_HDOP,		F1,		fid->gga.hdop)									\
+	COL(RAD_ALT,		F1,		fid->ral.agl_height)							\
+	COL(LINE_NUM,		INT,	fid->line.line_nr)								\
+	COL(BAR,			F2,		fid->bar.pressure)								\
+	COL(TRM,			F2,		fid->trm.temperature)							\
+	COL(HUM,			F2,		fid->hum.humidity)								\
+	COL(MAG,			EMPTY,	0)												\
+	COL(MAG_AMP,		EMPTY,	0)												\
+	COL(RSX_TIME,		LONG,	fid->rsx.rsx_time)								\
+	ARR(CR,				CHAR,	NR_CRYSTALS, 2, fid->rsx.crystal_labels)		\
+	ARR(CR_ERR,			INT,	NR_CRYSTALS, 2, fid->rsx.crystal_error_flags)	\
+	COL(ACQ_TIME_D,		LONG,	fid->rsx.vd_dn.acq_time)						\
+	COL(ACQ_TIME_U,		LONG,	fid->rsx.vd_up.acq_time)						\
+	COL(LIVE_TIME_D,	LONG,	fid->rsx.vd_dn.live_time)						\
+	COL(LIVE_TIME_U,	LONG,	fid->rsx.vd_up.live_time)						\
+	COL(GAMMA_TOTAL_D,	INT,	fid->rsx.vd_dn.total_gamma_count)				\
+	COL(GAMMA_TOTAL_U,	INT,	fid->rsx.vd_up.total_gamma_count)
+
+typedef enum schema_kind_t {
+#define SCHEMA_KIND_ENUM(kind, type)	KIND_##kind,
+	SCHEMA_KINDS(SCHEMA_KIND_ENUM)
+#undef SCHEMA_KIND_ENUM
+	NR_SCHEMA_KINDS
+} schema_kind_t;
+
+#define SCHEMA_KIND_TYPEDEF(kind, type)	typedef type kind_##kind##_t;
+SCHEMA_KINDS(SCHEMA_KIND_TYPEDEF)
+#undef SCHEMA_KIND_TYPEDEF
+
+/* One output row, laid out from FIDUCIAL_COLUMNS. */
+struct fiducial_row {
+#define SCHEMA_ROW_COL(name, kind, value)				kind_##kind##_t name;
+#define SCHEMA_ROW_ARR(name, kind, count, digits, array)	kind_##kind##_t name[count];
+	FIDUCIAL_COLUMNS(SCHEMA_ROW_COL, SCHEMA_ROW_ARR)
+#undef SCHEMA_ROW_COL
+#undef SCHEMA_ROW_ARR
+};
+
+/* Binary writer descriptor of one column of struct fiducial_row. */
+struct schema_column {
+	const char *name;
+	schema_kind_t kind;
+	unsigned int count;			/* 1, or the number of array elements */
+	size_t size;				/* size of one element */
+	size_t offset;				/* offset in struct fiducial_row */
+};
+
+extern const struct schema_column schema_columns[];
+extern const unsigned int nr_schema_columns;
+
+extern void schema_gather_row(struct fiducial_row *row, const struct fiducial_data *fid);
+
+/*
+ * Binary fiducial file layout, native byte order:
+ *   char     magic[4]   "AGDF"
+ *   uint32   version    1
+ *   uint32   nr_columns
+ * nr_columns descriptors of
+ *   char     name[16]   column name, zero padded
+ *   uint32   kind       schema_kind_t
+ *   uint32   count      number of elements
+ *   uint32   size       size of one element
+ * followed by one record per fiducial, the elements of every column
+ * packed back to back in column order.
+ */
+extern int schema_open_file(const char *filename);
+extern void schema_push(const struct fiducial_data *fid);
+extern void schema_close_file(void);
+
+#endif	/* SCHEMA_H_INCLUDED */
@@ -0,0 +1,463 @@
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "csv.h"
+#include "shard.h"
+#include "parse.h"
+#include "debug.h"
+
+#define SHARD_BUFFER		(64 * 1024)	/* bytes buffered before a shard is written */
+#define SHARD_PATH_MAX		1024
+#define CHUNKS_PER_WRITER	4			/* full buffers queued per writer thread */
+
+/*
+ * One output file per flight line (and date). Rows are formatted into
+ * the shard's own buffer. A full buffer, or the buffer of a line just
+ * left, is handed over as a chunk to background writer threads, so
+ * extraction only waits when too many chunks are queued. Writers take
+ * the file handle from a bounded pool that closes the least recently
+ * used idle handle when it runs out. The chunks of one shard are
+ * written by one writer at a time, in order.
+ */
+struct shard_chunk {
+	struct csv_buffer buf;
+	struct shard_chunk *next;
+};
+
+struct shard {
+	unsigned int line_nr;
+	unsigned long date;			/* yyyymmdd, 0 unless sharding by date */
+	char path[SHARD_PATH_MAX];
+	struct csv_buffer buf;		/* rows being formatted */
+	struct shard_chunk *head;	/* chunks waiting to be written */
+	struct shard_chunk *tail;
+	int queued;					/* on the ready list or being written */
+	struct shard *ready_next;
+	FILE *fp;
+	int created;				/* file exists, reopen appends */
+	int busy;					/* handle in use, must not be evicted */
+	struct shard *lru_prev;		/* open handles, most recent first */
+	struct shard *lru_next;
+};
+
+static struct {
+	const char *dir;
+	int per_date;
+	unsigned int max_open;
+	struct shard **table;		/* open addressing hash of shards */
+	unsigned long table_size;
+	unsigned long nr_shards;
+	struct shard *current;
+	pthread_t *writers;
+	unsigned int nr_writers;
+	pthread_mutex_t lock;		/* everything below */
+	pthread_cond_t work;		/* a shard is ready or the writers stop */
+	pthread_cond_t room;		/* a chunk was written */
+	struct shard *ready_head;
+	struct shard *ready_tail;
+	struct shard_chunk *free_chunks;
+	unsigned int nr_chunks;		/* chunks queued or being written */
+	unsigned int max_chunks;
+	struct shard *lru_head;
+	struct shard *lru_tail;
+	unsigned int nr_open;
+	int stop;
+	int failed;
+} shards;
+
+static inline unsigned long shard_hash(unsigned int line_nr, unsigned long date)
+{
+	return (line_nr * 2654435761UL) ^ (date * 40503UL);
+}
+
+static void lru_unlink(struct shard *s)
+{
+	if (s->lru_prev)
+		s->lru_prev->lru_next = s->lru_next;
+	else
+		shards.lru_head = s->lru_next;
+	if (s->lru_next)
+		s->lru_next->lru_prev = s->lru_prev;
+	else
+		shards.lru_tail = s->lru_prev;
+	s->lru_prev = s->lru_next = NULL;
+}
+
+static void lru_push(struct shard *s)
+{
+	s->lru_next = shards.lru_head;
+	if (shards.lru_head)
+		shards.lru_head->lru_prev = s;
+	shards.lru_head = s;
+	if (shards.lru_tail == NULL)
+		shards.lru_tail = s;
+}
+
+/* Caller holds the lock. */
+static void close_handle(struct shard *s)
+{
+	if (s->fp == NULL)
+		return;
+	lru_unlink(s);
+	if (fclose(s->fp) != 0) {
+		DEBUG("Failed to write shard: %s", s->path);
+		shards.failed = 1;
+	}
+	s->fp = NULL;
+	shards.nr_open--;
+}
+
+/*
+ * Caller holds the lock. There are no more writers than handles, so
+ * an idle handle to evict is always found.
+ */
+static FILE *acquire_handle(struct shard *s)
+{
+	s->busy = 1;
+	if (s->fp) {
+		lru_unlink(s);
+		lru_push(s);
+		return s->fp;
+	}
+
+	while (shards.nr_open >= shards.max_open) {
+		struct shard *victim = shards.lru_tail;
+
+		while (victim && victim->busy)
+			victim = victim->lru_prev;
+		if (victim == NULL)
+			break;
+		close_handle(victim);
+	}
+
+	s->fp = fopen(s->path, s->created ? "a" : "w");
+	if (s->fp == NULL) {
+		DEBUG("Failed to open file: %s", s->path);
+		return NULL;
+	}
+	s->created = 1;
+	lru_push(s);
+	shards.nr_open++;
+	return s->fp;
+}
+
+/* Caller holds the lock, returns with it held. */
+static void write_shard(struct shard *s)
+{
+	struct shard_chunk *c;
+
+	while ((c = s->head) != NULL) {
+		FILE *fp = acquire_handle(s);
+		int ok;
+
+		s->head = c->next;
+		if (s->head == NULL)
+			s->tail = NULL;
+
+		pthread_mutex_unlock(&shards.lock);
+		ok = fp && fwrite(c->buf.data, c->buf.len, 1, fp) == 1 && fflush(fp) == 0;
+		pthread_mutex_lock(&shards.lock);
+
+		if (!ok) {
+			DEBUG("Failed to write shard: %s", s->path);
+			shards.failed = 1;
+		}
+		s->busy = 0;
+		c->buf.len = 0;
+		c->next = shards.free_chunks;
+		shards.free_chunks = c;
+		shards.nr_chunks--;
+		pthread_cond_broadcast(&shards.room);
+	}
+	s->queued = 0;
+}
+
+static struct shard *pop_ready(void)
+{
+	struct shard *s = shards.ready_head;
+
+	if (s) {
+		shards.ready_head = s->ready_next;
+		if (shards.ready_head == NULL)
+			shards.ready_tail = NULL;
+		s->ready_next = NULL;
+	}
+	return s;
+}
+
+static void *writer_thread(void *arg)
+{
+	struct shard *s;
+
+	(void)arg;
+	pthread_mutex_lock(&shards.lock);
+	for (;;) {
+		while (shards.ready_head == NULL && !shards.stop)
+			pthread_cond_wait(&shards.work, &shards.lock);
+		s = pop_ready();
+		if (s == NULL)
+			break;
+		write_shard(s);
+	}
+	pthread_mutex_unlock(&shards.lock);
+	return NULL;
+}
+
+/* Hands the rows buffered for a shard over to the writers. */
+static void submit_shard(struct shard *s)
+{
+	struct shard_chunk *c;
+
+	if (s->buf.len == 0)
+		return;
+
+	pthread_mutex_lock(&shards.lock);
+	while (shards.nr_writers && shards.nr_chunks >= shards.max_chunks)
+		pthread_cond_wait(&shards.room, &shards.lock);
+
+	c = shards.free_chunks;
+	if (c)
+		shards.free_chunks = c->next;
+	else
+		c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		DEBUG("Out of memory, shard rows dropped: %s", s->path);
+		shards.failed = 1;
+		s->buf.len = 0;
+		pthread_mutex_unlock(&shards.lock);
+		return;
+	}
+
+	/* The chunk takes the full buffer, the shard gets the chunk's empty one */
+	{
+		struct csv_buffer tmp = c->buf;
+
+		c->buf = s->buf;
+		s->buf = tmp;
+	}
+	c->next = NULL;
+	if (s->tail)
+		s->tail->next = c;
+	else
+		s->head = c;
+	s->tail = c;
+	shards.nr_chunks++;
+
+	if (!s->queued) {
+		s->queued = 1;
+		if (shards.ready_tail)
+			shards.ready_tail->ready_next = s;
+		else
+			shards.ready_head = s;
+		shards.ready_tail = s;
+		pthread_cond_signal(&shards.work);
+	}
+
+	/* No writer could be started, write in the caller */
+	if (shards.nr_writers == 0) {
+		while ((s = pop_ready()) != NULL)
+			write_shard(s);
+	}
+	pthread_mutex_unlock(&shards.lock);
+}
+
+static int grow_table(void)
+{
+	unsigned long size = shards.table_size ? 2 * shards.table_size : 64;
+	struct shard **table = calloc(size, sizeof(*table));
+	register unsigned long i, j;
+
+	if (table == NULL) {
+		DEBUG("Out of memory.");
+		return -1;
+	}
+
+	for (i = 0; i < shards.table_size; i++) {
+		struct shard *s = shards.table[i];
+
+		if (s == NULL)
+			continue;
+		for (j = shard_hash(s->line_nr, s->date) & (size - 1); table[j];
+			j = (j + 1) & (size - 1))
+			;
+		table[j] = s;
+	}
+	free(shards.table);
+	shards.table = table;
+	shards.table_size = size;
+	return 0;
+}
+
+static struct shard *find_shard(unsigned int line_nr, unsigned long date)
+{
+	struct shard *s;
+	register unsigned long i;
+
+	if (2 * (shards.nr_shards + 1) > shards.table_size && grow_table() != 0)
+		return NULL;
+
+	for (i = shard_hash(line_nr, date) & (shards.table_size - 1); shards.table[i];
+		i = (i + 1) & (shards.table_size - 1)) {
+		s = shards.table[i];
+		if (s->line_nr == line_nr && s->date == date)
+			return s;
+	}
+
+	s = calloc(1, sizeof(*s));
+	if (s == NULL) {
+		DEBUG("Out of memory.");
+		return NULL;
+	}
+	s->line_nr = line_nr;
+	s->date = date;
+	if (shards.per_date)
+		snprintf(s->path, sizeof(s->path), "%s/%08lu_line%u.csv", shards.dir, date, line_nr);
+	else
+		snprintf(s->path, sizeof(s->path), "%s/line%u.csv", shards.dir, line_nr);
+	csv_format_header(&s->buf);
+
+	shards.table[i] = s;
+	shards.nr_shards++;
+	return s;
+}
+
+int shard_open(const char *dir, int per_date, unsigned int max_open,
+				unsigned int nr_threads)
+{
+	unsigned int nr_writers;
+	register unsigned int i;
+	int ret;
+
+	if (dir == NULL || max_open == 0)
+		return -1;
+
+#ifdef _WIN32
+	ret = mkdir(dir);
+#else
+	ret = mkdir(dir, 0755);
+#endif
+	if (ret != 0 && errno != EEXIST) {
+		DEBUG("Failed to create directory: %s", dir);
+		return -1;
+	}
+	errno = 0;
+
+	memset(&shards, 0, sizeof(shards));
+	shards.dir = dir;
+	shards.per_date = per_date;
+	shards.max_open = max_open;
+	pthread_mutex_init(&shards.lock, NULL);
+	pthread_cond_init(&shards.work, NULL);
+	pthread_cond_init(&shards.room, NULL);
+	if (grow_table() != 0)
+		return -1;
+
+	/* Every writer holds at most one handle */
+	nr_writers = nr_threads ? nr_threads : 1;
+	if (nr_writers > max_open)
+		nr_writers = max_open;
+	shards.max_chunks = CHUNKS_PER_WRITER * nr_writers;
+
+	shards.writers = calloc(nr_writers, sizeof(*shards.writers));
+	if (shards.writers == NULL) {
+		DEBUG("Out of memory, writing shards in caller.");
+		return 0;
+	}
+	for (i = 0; i < nr_writers; i++) {
+		if (pthread_create(&shards.writers[shards.nr_writers], NULL,
+							writer_thread, NULL) != 0) {
+			DEBUG("Failed to create shard writer thread.");
+			continue;
+		}
+		shards.nr_writers++;
+	}
+	return 0;
+}
+
+void shard_push(const struct fiducial_data *fid)
+{
+	unsigned long date = 0;
+	struct shard *s;
+
+	if (shards.table == NULL)
+		return;
+
+	if (shards.per_date) {
+		date = fid->zda.utc.tm_year * 10000UL + fid->zda.utc.tm_mon * 100UL +
+				fid->zda.utc.tm_mday;
+	}
+
+	s = find_shard(fid->line.line_nr, date);
+	if (s == NULL) {
+		pthread_mutex_lock(&shards.lock);
+		shards.failed = 1;
+		pthread_mutex_unlock(&shards.lock);
+		return;
+	}
+
+	/*
+	 * The line just left is written out so that downstream jobs can
+	 * pick it up while extraction goes on. Its handle stays in the
+	 * pool in case the line is flown again.
+	 */
+	if (shards.current && shards.current != s)
+		submit_shard(shards.current);
+	shards.current = s;
+
+	csv_format_row(&s->buf, fid);
+	if (s->buf.len >= SHARD_BUFFER)
+		submit_shard(s);
+}
+
+int shard_close(void)
+{
+	struct shard_chunk *c;
+	register unsigned long i;
+	int ret;
+
+	if (shards.table == NULL)
+		return -1;
+
+	for (i = 0; i < shards.table_size; i++) {
+		if (shards.table[i])
+			submit_shard(shards.table[i]);
+	}
+
+	pthread_mutex_lock(&shards.lock);
+	shards.stop = 1;
+	pthread_cond_broadcast(&shards.work);
+	pthread_mutex_unlock(&shards.lock);
+	for (i = 0; i < shards.nr_writers; i++)
+		pthread_join(shards.writers[i], NULL);
+
+	pthread_mutex_lock(&shards.lock);
+	for (i = 0; i < shards.table_size; i++) {
+		struct shard *s = shards.table[i];
+
+		if (s == NULL)
+			continue;
+		close_handle(s);
+		csv_buffer_free(&s->buf);
+		free(s);
+	}
+	while ((c = shards.free_chunks) != NULL) {
+		shards.free_chunks = c->next;
+		csv_buffer_free(&c->buf);
+		free(c);
+	}
+	ret = shards.failed ? -1 : 0;
+	pthread_mutex_unlock(&shards.lock);
+
+	pthread_mutex_destroy(&shards.lock);
+	pthread_cond_destroy(&shards.work);
+	pthread_cond_destroy(&shards.room);
+	free(shards.writers);
+	free(shards.table);
+	memset(&shards, 0, sizeof(shards));
+	return ret;
+}
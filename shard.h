@@ -0,0 +1,13 @@
+#ifndef SHARD_H_INCLUDED
+#define SHARD_H_INCLUDED
+
+struct fiducial_data;
+
+#define SHARD_MAX_OPEN		64		/* default limit of open shard files */
+
+extern int shard_open(const char *dir, int per_date, unsigned int max_open,
+						unsigned int nr_threads);
+extern void shard_push(const struct fiducial_data *fid);
+extern int shard_close(void);
+
+#endif	/* SHARD_H_INCLUDED */
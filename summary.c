@@ -0,0 +1,312 @@
+#include <math.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "summary.h"
+#include "parse.h"
+#include "debug.h"
+
+static const char *sensor_names[NR_SENSORS] = {
+	"Temperature", "Humidity", "Pressure", "RSX",
+	"GPS GPGGA", "GPS GPZDA", "NAV RDALT", "NAV LINE"
+};
+
+static const size_t sensor_offsets[NR_SENSORS] = {
+	offsetof(struct fiducial_data, trm.prev_timestamp),
+	offsetof(struct fiducial_data, hum.prev_timestamp),
+	offsetof(struct fiducial_data, bar.prev_timestamp),
+	offsetof(struct fiducial_data, rsx.prev_timestamp),
+	offsetof(struct fiducial_data, gga.prev_timestamp),
+	offsetof(struct fiducial_data, zda.prev_timestamp),
+	offsetof(struct fiducial_data, ral.prev_timestamp),
+	offsetof(struct fiducial_data, line.prev_timestamp),
+};
+
+static const char *field_names[NR_SUMMARY_FIELDS] = {
+	"TC", "LIVE_TIME", "RAD_ALT", "HDOP", "SATS"
+};
+
+static inline void welford_add(struct welford *w, double x)
+{
+	double delta = x - w->mean;
+
+	if (w->n == 0 || x < w->min)
+		w->min = x;
+	if (w->n == 0 || x > w->max)
+		w->max = x;
+	w->n++;
+	w->mean += delta / w->n;
+	w->m2 += delta * (x - w->mean);
+}
+
+/* Pairwise combination of two partial accumulators (Chan et al.). */
+static void welford_merge(struct welford *a, const struct welford *b)
+{
+	unsigned long n = a->n + b->n;
+	double delta = b->mean - a->mean;
+
+	if (b->n == 0)
+		return;
+	if (a->n == 0) {
+		*a = *b;
+		return;
+	}
+	a->mean += delta * b->n / n;
+	a->m2 += b->m2 + delta * delta * a->n * b->n / n;
+	a->min = b->min < a->min ? b->min : a->min;
+	a->max = b->max > a->max ? b->max : a->max;
+	a->n = n;
+}
+
+void summary_init(struct summary *sum)
+{
+	memset(sum, 0, sizeof(*sum));
+}
+
+void summary_free(struct summary *sum)
+{
+	free(sum->lines);
+	free(sum->gaps);
+	memset(sum, 0, sizeof(*sum));
+}
+
+static struct line_summary *find_line(struct summary *sum, unsigned int line_nr)
+{
+	struct line_summary *ln;
+	register unsigned int i;
+
+	if (sum->nr_lines && sum->lines[sum->last_line].line_nr == line_nr)
+		return &sum->lines[sum->last_line];
+
+	for (i = 0; i < sum->nr_lines; i++) {
+		if (sum->lines[i].line_nr == line_nr) {
+			sum->last_line = i;
+			return &sum->lines[i];
+		}
+	}
+
+	if (sum->nr_lines == sum->max_lines) {
+		unsigned int max = sum->max_lines ? 2 * sum->max_lines : 64;
+		struct line_summary *tmp = realloc(sum->lines, max * sizeof(*tmp));
+
+		if (tmp == NULL) {
+			DEBUG("Out of memory.");
+			return NULL;
+		}
+		sum->lines = tmp;
+		sum->max_lines = max;
+	}
+
+	ln = &sum->lines[sum->nr_lines];
+	memset(ln, 0, sizeof(*ln));
+	ln->line_nr = line_nr;
+	sum->last_line = sum->nr_lines++;
+	return ln;
+}
+
+static void add_gap(struct summary *sum, sensor_t sensor, unsigned int line_nr,
+					double start, double duration)
+{
+	struct line_summary *ln;
+
+	if (sum->nr_gaps == sum->max_gaps) {
+		unsigned long max = sum->max_gaps ? 2 * sum->max_gaps : 64;
+		struct data_gap *tmp = realloc(sum->gaps, max * sizeof(*tmp));
+
+		if (tmp == NULL) {
+			DEBUG("Out of memory.");
+			return;
+		}
+		sum->gaps = tmp;
+		sum->max_gaps = max;
+	}
+	sum->gaps[sum->nr_gaps].sensor = sensor;
+	sum->gaps[sum->nr_gaps].line_nr = line_nr;
+	sum->gaps[sum->nr_gaps].start = start;
+	sum->gaps[sum->nr_gaps].duration = duration;
+	sum->nr_gaps++;
+
+	ln = find_line(sum, line_nr);
+	if (ln)
+		ln->nr_gaps++;
+}
+
+void summary_update(struct summary *sum, const struct fiducial_data *fid)
+{
+	struct line_summary *ln;
+	int fresh[NR_SENSORS];
+	register unsigned int s;
+
+	/* A gap is recorded once its sensor delivers data again */
+	for (s = 0; s < NR_SENSORS; s++) {
+		double seen = *(const double *)((const char *)fid + sensor_offsets[s]);
+
+		if (sum->started && seen - sum->last_seen[s] >= GAP_DURATION)
+			add_gap(sum, s, fid->line.line_nr, sum->last_seen[s], seen - sum->last_seen[s]);
+		fresh[s] = !sum->started || seen != sum->last_seen[s];
+		sum->last_seen[s] = seen;
+	}
+	sum->rec_time = fid->rec_time;
+	sum->started = 1;
+
+	ln = find_line(sum, fid->line.line_nr);
+	if (ln == NULL)
+		return;
+	ln->nr_fiducials++;
+
+	/* Only values decoded this second, held values would skew the stats */
+	if (fid->rsx.seen && fresh[SENSOR_RSX]) {
+		welford_add(&ln->stats[SUM_TOTAL_COUNT], fid->rsx.vd_dn.total_gamma_count);
+		welford_add(&ln->stats[SUM_LIVE_TIME], fid->rsx.vd_dn.live_time);
+	}
+	if (fid->ral.seen && fresh[SENSOR_RDALT])
+		welford_add(&ln->stats[SUM_RADAR_ALT], fid->ral.agl_height);
+	if (fid->gga.seen && fresh[SENSOR_GPGGA]) {
+		welford_add(&ln->stats[SUM_HDOP], fid->gga.hdop);
+		welford_add(&ln->stats[SUM_NSAT], fid->gga.nsat);
+	}
+}
+
+/* Records gaps still open at the end of a stream. */
+void summary_finish(struct summary *sum)
+{
+	unsigned int line_nr = sum->nr_lines ? sum->lines[sum->last_line].line_nr : 0;
+	register unsigned int s;
+
+	for (s = 0; sum->started && s < NR_SENSORS; s++) {
+		if (sum->rec_time - sum->last_seen[s] >= GAP_DURATION)
+			add_gap(sum, s, line_nr, sum->last_seen[s], sum->rec_time - sum->last_seen[s]);
+		sum->last_seen[s] = sum->rec_time;
+	}
+}
+
+static int compare_gaps(const void *a, const void *b)
+{
+	const struct data_gap *ga = a, *gb = b;
+
+	if (ga->start != gb->start)
+		return ga->start < gb->start ? -1 : 1;
+	return (int)ga->sensor - (int)gb->sensor;
+}
+
+int summary_merge(struct summary *dst, const struct summary *src)
+{
+	register unsigned long i;
+	register unsigned int f;
+
+	for (i = 0; i < src->nr_lines; i++) {
+		struct line_summary *ln = find_line(dst, src->lines[i].line_nr);
+
+		if (ln == NULL)
+			return -1;
+		ln->nr_fiducials += src->lines[i].nr_fiducials;
+		ln->nr_gaps += src->lines[i].nr_gaps;
+		for (f = 0; f < NR_SUMMARY_FIELDS; f++)
+			welford_merge(&ln->stats[f], &src->lines[i].stats[f]);
+	}
+
+	if (src->nr_gaps == 0)
+		return 0;
+
+	if (dst->nr_gaps + src->nr_gaps > dst->max_gaps) {
+		unsigned long max = dst->nr_gaps + src->nr_gaps;
+		struct data_gap *tmp = realloc(dst->gaps, max * sizeof(*tmp));
+
+		if (tmp == NULL) {
+			DEBUG("Out of memory.");
+			return -1;
+		}
+		dst->gaps = tmp;
+		dst->max_gaps = max;
+	}
+	memcpy(&dst->gaps[dst->nr_gaps], src->gaps, src->nr_gaps * sizeof(*src->gaps));
+	dst->nr_gaps += src->nr_gaps;
+	qsort(dst->gaps, dst->nr_gaps, sizeof(*dst->gaps), compare_gaps);
+	return 0;
+}
+
+void summary_print_gaps(const struct summary *sum, FILE *fp)
+{
+	register unsigned long i;
+
+	if (sum->nr_gaps == 0)
+		return;
+
+	fprintf(fp, "%-12s %-6s %-16s %s\n", "SENSOR", "LINE", "START", "DURATION");
+	for (i = 0; i < sum->nr_gaps; i++) {
+		const struct data_gap *g = &sum->gaps[i];
+
+		fprintf(fp, "%-12s %-6u %-16lf %.0lf\n", sensor_names[g->sensor],
+				g->line_nr, g->start, g->duration);
+	}
+}
+
+static int compare_lines(const void *a, const void *b)
+{
+	const struct line_summary *la = a, *lb = b;
+
+	return la->line_nr < lb->line_nr ? -1 : la->line_nr > lb->line_nr;
+}
+
+int summary_write(const struct summary *sum, const char *filename)
+{
+	struct line_summary *lines = NULL;
+	FILE *fp = NULL;
+	register unsigned int i, f;
+
+	if (filename == NULL)
+		return -1;
+
+	fp = fopen(filename, "w");
+	if (fp == NULL) {
+		DEBUG("Failed to open file: %s", filename);
+		return -1;
+	}
+
+	fprintf(fp, "%s", "LINE_NUM,FIDUCIALS,GAPS,");
+	for (f = 0; f < NR_SUMMARY_FIELDS; f++) {
+		fprintf(fp, "%s_MIN,%s_MAX,%s_MEAN,%s_STD,", field_names[f], field_names[f],
+				field_names[f], field_names[f]);
+	}
+	fprintf(fp, "%s", "\n");
+
+	lines = malloc(sum->nr_lines * sizeof(*lines) + 1);
+	if (lines == NULL) {
+		DEBUG("Out of memory.");
+		fclose(fp);
+		return -1;
+	}
+	memcpy(lines, sum->lines, sum->nr_lines * sizeof(*lines));
+	qsort(lines, sum->nr_lines, sizeof(*lines), compare_lines);
+
+	for (i = 0; i < sum->nr_lines; i++) {
+		const struct line_summary *ln = &lines[i];
+
+		fprintf(fp, "%u,%lu,%lu,", ln->line_nr, ln->nr_fiducials, ln->nr_gaps);
+		for (f = 0; f < NR_SUMMARY_FIELDS; f++) {
+			const struct welford *w = &ln->stats[f];
+			double std = w->n > 1 ? sqrt(w->m2 / (w->n - 1)) : 0.0;
+
+			if (w->n == 0) {
+				fprintf(fp, "%s", ",,,,");
+				continue;
+			}
+			fprintf(fp, "%.2lf,%.2lf,%.2lf,%.2lf,", w->min, w->max, w->mean, std);
+		}
+		fprintf(fp, "%s", "\n");
+	}
+	free(lines);
+
+	fprintf(fp, "%s", "\nSENSOR,LINE_NUM,START,DURATION,\n");
+	for (i = 0; i < sum->nr_gaps; i++) {
+		const struct data_gap *g = &sum->gaps[i];
+
+		fprintf(fp, "%s,%u,%lf,%.0lf,\n", sensor_names[g->sensor], g->line_nr,
+				g->start, g->duration);
+	}
+	fclose(fp);
+	return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef SUMMARY_H_INCLUDED
+#define SUMMARY_H_INCLUDED
+
+#include <stdio.h>
+
+struct fiducial_data;
+
+#define GAP_DURATION		3		/* seconds without data counted as a gap */
+
+typedef enum summary_field_t {
+	SUM_TOTAL_COUNT = 0,
+	SUM_LIVE_TIME,
+	SUM_RADAR_ALT,
+	SUM_HDOP,
+	SUM_NSAT,
+	NR_SUMMARY_FIELDS
+} summary_field_t;
+
+typedef enum sensor_t {
+	SENSOR_TRM = 0,
+	SENSOR_HUM,
+	SENSOR_BAR,
+	SENSOR_RSX,
+	SENSOR_GPGGA,
+	SENSOR_GPZDA,
+	SENSOR_RDALT,
+	SENSOR_LINE,
+	NR_SENSORS
+} sensor_t;
+
+/* Running mean and variance (Welford). */
+struct welford {
+	unsigned long n;
+	double mean;
+	double m2;
+	double min;
+	double max;
+};
+
+struct line_summary {
+	unsigned int line_nr;
+	unsigned long nr_fiducials;
+	unsigned long nr_gaps;
+	struct welford stats[NR_SUMMARY_FIELDS];
+};
+
+struct data_gap {
+	sensor_t sensor;
+	unsigned int line_nr;
+	double start;				/* last rec time the sensor had data */
+	double duration;			/* seconds */
+};
+
+struct summary {
+	struct line_summary *lines;
+	unsigned int nr_lines;
+	unsigned int max_lines;
+	unsigned int last_line;		/* index of the most recently used line */
+	struct data_gap *gaps;
+	unsigned long nr_gaps;
+	unsigned long max_gaps;
+	double last_seen[NR_SENSORS];
+	double rec_time;
+	int started;
+};
+
+extern void summary_init(struct summary *sum);
+extern void summary_free(struct summary *sum);
+extern void summary_update(struct summary *sum, const struct fiducial_data *fid);
+extern void summary_finish(struct summary *sum);
+extern int summary_merge(struct summary *dst, const struct summary *src);
+extern void summary_print_gaps(const struct summary *sum, FILE *fp);
+extern int summary_write(const struct summary *sum, const char *filename);
+
+#endif	/* SUMMARY_H_INCLUDED */